@@ -5,7 +5,20 @@
 #include <linux/types.h>
 #include <linux/cdev.h>
 #include <linux/fs.h>
+#include <linux/file.h>
 #include <linux/dma-mapping.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/shmem_fs.h>
+#include <linux/pagemap.h>
+#include <linux/vmalloc.h>
+#include <linux/hrtimer.h>
+#include <linux/kref.h>
+#include <linux/workqueue.h>
+#include <linux/dma-buf.h>
+#include <linux/idr.h>
+#include <linux/mutex.h>
+#include <linux/sched/signal.h>
 
 #include "binderlike-core.h"
 
@@ -27,22 +40,77 @@ struct moa_binderlike_chan {
 	int                                       chan_id;
 	struct moa_binderlike_chan_queue          sq;
 	struct moa_binderlike_chan_queue          cq;
+	/* capture ring of the sq, q is NULL without one */
+	struct moa_binderlike_chan_queue          cap;
 	unsigned int                              memblk_size;
-	dma_addr_t                                dma_addr;
+	/* ring memory, shmem backed so userspace can futex on it */
+	struct file                              *shm;
+	struct page                             **pages;
 	struct list_head                          chan_node;
+
+	/* consumers sleeping in read/poll */
+	wait_queue_head_t                         wq;
+	/* bounds the delay of coalesced wakeups */
+	struct hrtimer                            notify_timer;
+
+	/* held by the creating file and by in-kernel clients */
+	struct kref                               ref;
+	/* in-kernel consumer, drained from consume_work */
+	moa_binderlike_consume_fn                 consume_fn;
+	void                                     *consume_priv;
+	/* bit 0 is taken by the registered consumer, fn is published last */
+	unsigned long                             consume_busy;
+	struct work_struct                        consume_work;
+
+	/* payload arena, NULL when the chan was created without one */
+	struct moa_binderlike_arena              *arena;
+	/* blocks of BINDERLIKE_ARENA_BLK_SIZE, the header copy is user's */
+	unsigned int                              arena_blk_cnt;
+
+	/* dma-bufs in flight, named by the handle of their entry */
+	struct idr                                dmabuf_idr;
+	spinlock_t                                dmabuf_lock;
+	unsigned int                              dmabuf_cnt;
+
+	/* files with admission set up, and their producer ids */
+	struct list_head                          qos_list;
+	spinlock_t                                qos_lock;
+	unsigned long                             producer_ids;
 };
 
 struct moa_binderlike_device {
 	struct platform_device                   *pdev;
 	int                                       max_queue_len;
 	struct cdev                               cdev;
+	/* first of BINDERLIKE_CHAN_MAX + 1 minors, the control node */
+	dev_t                                     devt;
 
 	struct list_head                          chan_head;
 	struct moa_binderlike_chan               *chan_map[BINDERLIKE_CHAN_MAX];
+	/* protects chan_map against lookups from atomic context */
+	spinlock_t                                chan_lock;
+	/* an id is only reused once the node of its last chan is gone */
+	struct mutex                              chan_mutex;
+
+	/* readiness page shared with every process, see wait-any */
+	struct page                              *ready_page;
+	struct moa_binderlike_ready              *ready;
+	wait_queue_head_t                         ready_wq;
 };
 
 struct moa_binderlike_fh {
 	struct moa_binderlike_chan                *chan;
+	/* fh created the chan on the control node and unregisters it */
+	bool                                      owner;
+
+	/* admission on fh->chan, producer is 0 until it is set up */
+	struct list_head                          qos_node;
+	struct moa_binderlike_qos                 qos;
+	/* bucket fill in 1 / NSEC_PER_SEC msgs */
+	u64                                       tokens;
+	u64                                       refill_ns;
+	/* fh->chan ring is mapped, its producers bypass admission */
+	bool                                      mapped;
 };
 
 static struct moa_binderlike_device *g_bdev = NULL;
@@ -86,15 +154,710 @@ static void moa_binderlike_parse_dt(struct moa_binderlike_device *bdev)
 	}
 }
 
-static DEFINE_SPINLOCK(wr_spin);
+/*
+ * head and tail live in the user writable mapping. Load each once and
+ * only hand out values that index our ring, a forged one must neither
+ * reach msgs[] nor keep a walk to tail going forever.
+ */
+static inline bool
+moa_binderlike_queue_load(const struct moa_binderlike_chan_queue *cq,
+			  u32 *head, u32 *tail)
+{
+	*head = smp_load_acquire(&cq->q->head);
+	*tail = READ_ONCE(cq->q->tail);
+	return *head < cq->cache_cnt && *tail < cq->cache_cnt;
+}
+
+/* cur is the checked head index when it returns true */
+static inline bool
+moa_binderlike_queue_pending(const struct moa_binderlike_chan_queue *cq,
+			     u32 *cur)
+{
+	u32 head, tail;
+
+	if (!moa_binderlike_queue_load(cq, &head, &tail) || head == tail)
+		return false;
+
+	*cur = head;
+	/* a claimed slot is only visible once its producer published it */
+	return smp_load_acquire(&cq->q->msgs[head].state) ==
+	       MOA_BINDERLIKE_MSG_READY;
+}
+
+/* take the head entry of a conflating queue away from its producers */
+static inline bool moa_binderlike_queue_claim(struct moa_binderlike_queue *q,
+					      u32 cur)
+{
+	if (!(READ_ONCE(q->flags) & MOA_BINDERLIKE_QUEUE_CONFLATE))
+		return true;
+	return cmpxchg(&q->msgs[cur].state, MOA_BINDERLIKE_MSG_READY,
+		       MOA_BINDERLIKE_MSG_BUSY) == MOA_BINDERLIKE_MSG_READY;
+}
+
+static inline int moa_binderlike_fetch_or(volatile int *p, int set)
+{
+	int old;
+
+	do {
+		old = READ_ONCE(*p);
+	} while (cmpxchg(p, old, old | set) != old);
+	return old;
+}
+
+static inline int moa_binderlike_fetch_andnot(volatile int *p, int clr)
+{
+	int old;
+
+	do {
+		old = READ_ONCE(*p);
+	} while (cmpxchg(p, old, old & ~clr) != old);
+	return old;
+}
+
+static inline int moa_binderlike_fetch_inc(volatile int *p)
+{
+	int old;
+
+	do {
+		old = READ_ONCE(*p);
+	} while (cmpxchg(p, old, old + 1) != old);
+	return old;
+}
+
+/* flag the chan in the readiness page, skip the atomic if it is set */
+static bool moa_binderlike_chan_mark_ready(struct moa_binderlike_chan *chan)
+{
+	struct moa_binderlike_device *bdev = g_bdev;
+
+	if (!bdev || !bdev->ready || chan->chan_id < 0)
+		return false;
+
+	if (!(READ_ONCE(bdev->ready->bits) & BIT(chan->chan_id)))
+		moa_binderlike_fetch_or((volatile int *)&bdev->ready->bits,
+					BIT(chan->chan_id));
+	return true;
+}
+
+static void moa_binderlike_chan_wake(struct moa_binderlike_chan *chan)
+{
+	if (moa_binderlike_chan_mark_ready(chan))
+		wake_up_interruptible(&g_bdev->ready_wq);
+
+	wake_up_interruptible(&chan->wq);
+	if (READ_ONCE(chan->consume_fn))
+		queue_work(system_highpri_wq, &chan->consume_work);
+}
+
+static void moa_binderlike_chan_notify(struct moa_binderlike_chan *chan)
+{
+	struct moa_binderlike_queue *q = chan->sq.q;
+
+	WRITE_ONCE(q->unnotified, 0);
+
+	/* futex sleepers keep their bit, only userspace can wake them */
+	if (moa_binderlike_fetch_andnot(&q->need_wakeup,
+					MOA_BINDERLIKE_WAKE_KERNEL) &
+	    MOA_BINDERLIKE_WAKE_KERNEL)
+		moa_binderlike_chan_wake(chan);
+}
+
+static enum hrtimer_restart moa_binderlike_notify_timer(struct hrtimer *timer)
+{
+	struct moa_binderlike_chan *chan =
+		container_of(timer, struct moa_binderlike_chan, notify_timer);
+
+	moa_binderlike_chan_notify(chan);
+	return HRTIMER_NORESTART;
+}
+
+static void moa_binderlike_chan_defer(struct moa_binderlike_chan *chan)
+{
+	struct moa_binderlike_queue *q = chan->sq.q;
+
+	if (hrtimer_active(&chan->notify_timer))
+		return;
+
+	hrtimer_start(&chan->notify_timer,
+		      ns_to_ktime((u64)READ_ONCE(q->coalesce_us) * NSEC_PER_USEC),
+		      HRTIMER_MODE_REL);
+}
+
+/* returns true when the wakeup is held back by coalescing */
+static bool moa_binderlike_chan_coalesce(struct moa_binderlike_chan *chan)
+{
+	struct moa_binderlike_queue *q = chan->sq.q;
+	int cnt = READ_ONCE(q->coalesce_cnt);
+
+	/* urgent chans wake on every msg */
+	if (cnt <= 1)
+		return false;
+
+	if (moa_binderlike_fetch_inc(&q->unnotified) + 1 >= cnt) {
+		hrtimer_try_to_cancel(&chan->notify_timer);
+		return false;
+	}
+
+	moa_binderlike_chan_defer(chan);
+	return true;
+}
+
+static void moa_binderlike_chan_kick(struct moa_binderlike_chan *chan)
+{
+	struct moa_binderlike_queue *q = chan->sq.q;
+
+	/* pairs with the barrier sleepers issue after setting need_wakeup */
+	smp_mb();
+	if (!(READ_ONCE(q->need_wakeup) & MOA_BINDERLIKE_WAKE_KERNEL))
+		return;
+
+	if (moa_binderlike_chan_coalesce(chan))
+		return;
+
+	moa_binderlike_chan_notify(chan);
+}
+
+static void moa_binderlike_chan_set_coalesce(struct moa_binderlike_chan *chan,
+					     unsigned int cnt, unsigned int us)
+{
+	struct moa_binderlike_queue *q = chan->sq.q;
+
+	/* a threshold the ring can never hold would only ever time out */
+	if (chan->sq.cache_cnt && cnt >= chan->sq.cache_cnt)
+		cnt = chan->sq.cache_cnt - 1;
+
+	if (us > BINDERLIKE_COALESCE_US_MAX)
+		us = BINDERLIKE_COALESCE_US_MAX;
+
+	/* the delay bound is what keeps a quiet coalesced chan moving */
+	if (cnt > 1 && !us)
+		us = BINDERLIKE_COALESCE_US_DEFAULT;
+
+	WRITE_ONCE(q->coalesce_us, us);
+	WRITE_ONCE(q->coalesce_cnt, cnt);
+
+	/* flush what the old setting held back */
+	hrtimer_try_to_cancel(&chan->notify_timer);
+	moa_binderlike_chan_notify(chan);
+
+	log_info("chan %d coalesce %u msgs, %u us\n", chan->chan_id, cnt, us);
+}
+
+/* cur may be NULL, otherwise it is the checked head index on true */
+static bool moa_binderlike_chan_ready_at(struct moa_binderlike_chan *chan,
+					 u32 *cur)
+{
+	struct moa_binderlike_queue *q = chan->sq.q;
+	u32 head;
+
+	moa_binderlike_fetch_or(&q->need_wakeup, MOA_BINDERLIKE_WAKE_KERNEL);
+	/* pairs with the barrier in moa_binderlike_chan_kick() */
+	smp_mb();
+	return moa_binderlike_queue_pending(&chan->sq, cur ? cur : &head);
+}
+
+static bool moa_binderlike_chan_ready(struct moa_binderlike_chan *chan)
+{
+	return moa_binderlike_chan_ready_at(chan, NULL);
+}
+
+static struct moa_binderlike_msg *
+moa_binderlike_queue_reserve(struct moa_binderlike_chan_queue *sq)
+{
+	struct moa_binderlike_queue *queue = sq->q;
+	u32 head, cur, new_tail;
+
+	/*
+	 * The cmpxchg only compares the bare index: a producer stalled
+	 * between the full check and the cmpxchg while the ring goes all
+	 * the way around could still win it against a stale head. Every
+	 * producer of the ring shares that window, an index with a
+	 * sequence tag would change the mmap layout.
+	 */
+	do {
+		if (!moa_binderlike_queue_load(sq, &head, &cur)) {
+			log_err("ring indexes %u/%u out of range\n", head, cur);
+			return ERR_PTR(-EINVAL);
+		}
+		new_tail = (cur + 1) % sq->cache_cnt;
+
+		if (head == new_tail)
+			return ERR_PTR(-EBUSY);
+	} while (cmpxchg(&queue->tail, cur, new_tail) != cur);
+
+	queue->msgs[cur].type = MOA_BINDERLIKE_MSG_TYPE_DATA;
+	queue->msgs[cur].handle = 0;
+	queue->msgs[cur].arena_off = 0;
+	queue->msgs[cur].arena_len = 0;
+	queue->msgs[cur].key = 0;
+	queue->msgs[cur].flags = 0;
+	queue->msgs[cur].deadline_ns = 0;
+	queue->msgs[cur].producer = 0;
+	return &queue->msgs[cur];
+}
+
+/*
+ * Claim the tail slot of the chan's sq. Safe from atomic and irq context,
+ * userspace producers race with us on the same tail.
+ */
+struct moa_binderlike_msg *
+moa_binderlike_chan_reserve(struct moa_binderlike_chan *chan)
+{
+	if (!chan)
+		return ERR_PTR(-ENOTTY);
+
+	/* its consumers may sleep on the futex, we could never wake them */
+	if (!(READ_ONCE(chan->sq.q->producers) & MOA_BINDERLIKE_PRODUCER_KERNEL))
+		return ERR_PTR(-EPERM);
+
+	return moa_binderlike_queue_reserve(&chan->sq);
+}
+EXPORT_SYMBOL(moa_binderlike_chan_reserve);
+
+/* copy an sq entry into the capture ring, never waits for its reader */
+static void moa_binderlike_chan_capture(struct moa_binderlike_chan *chan,
+					const struct moa_binderlike_msg *msg)
+{
+	struct moa_binderlike_queue *cap = chan->cap.q;
+	struct moa_binderlike_msg *rec;
+	u32 head, cur, next;
+
+	do {
+		/* the reader owns head, a forged index loses the record */
+		if (!moa_binderlike_queue_load(&chan->cap, &head, &cur)) {
+			moa_binderlike_fetch_inc(&cap->dropped);
+			return;
+		}
+		next = (cur + 1) % chan->cap.cache_cnt;
+
+		if (head == next) {
+			moa_binderlike_fetch_inc(&cap->dropped);
+			return;
+		}
+	} while (cmpxchg(&cap->tail, cur, next) != cur);
+
+	rec = &cap->msgs[cur];
+	rec->len = min_t(unsigned int, msg->len, sizeof(rec->content));
+	rec->type = msg->type;
+	rec->handle = msg->handle;
+	rec->arena_off = msg->arena_off;
+	rec->arena_len = msg->arena_len;
+	rec->key = msg->key;
+	rec->flags = msg->flags;
+	rec->deadline_ns = msg->deadline_ns;
+	rec->producer = msg->producer;
+	rec->ts_ns = ktime_get_ns();
+	memcpy(rec->content, msg->content, rec->len);
+	smp_store_release(&rec->state, MOA_BINDERLIKE_MSG_READY);
+}
+
+/* publish a slot from moa_binderlike_chan_reserve() and wake the consumer */
+void moa_binderlike_chan_commit(struct moa_binderlike_chan *chan,
+				struct moa_binderlike_msg *msg)
+{
+	/* the flag is user writable, the ring pointer is ours */
+	if ((READ_ONCE(chan->sq.q->flags) & MOA_BINDERLIKE_QUEUE_CAPTURE) &&
+	    chan->cap.q)
+		moa_binderlike_chan_capture(chan, msg);
+
+	smp_store_release(&msg->state, MOA_BINDERLIKE_MSG_READY);
+	moa_binderlike_chan_mark_ready(chan);
+	moa_binderlike_chan_kick(chan);
+}
+EXPORT_SYMBOL(moa_binderlike_chan_commit);
+
+/*
+ * Rewrite the pending DATA entry of key in place, NULL if there is none
+ * or the consumer took it first. The entry is returned BUSY.
+ */
+static struct moa_binderlike_msg *
+moa_binderlike_chan_conflate(struct moa_binderlike_chan *chan, unsigned int key)
+{
+	struct moa_binderlike_chan_queue *sq = &chan->sq;
+	struct moa_binderlike_queue *q = sq->q;
+	struct moa_binderlike_msg *msg;
+	u32 idx, tail;
+
+	if (!moa_binderlike_queue_load(sq, &idx, &tail))
+		return NULL;
+
+	for (; idx != tail; idx = (idx + 1) % sq->cache_cnt) {
+		msg = &q->msgs[idx];
+		if (READ_ONCE(msg->key) != key ||
+		    READ_ONCE(msg->type) != MOA_BINDERLIKE_MSG_TYPE_DATA)
+			continue;
+
+		if (cmpxchg(&msg->state, MOA_BINDERLIKE_MSG_READY,
+			    MOA_BINDERLIKE_MSG_BUSY) != MOA_BINDERLIKE_MSG_READY)
+			continue;
+
+		/* the slot may have been consumed and reused meanwhile */
+		if (msg->key == key && msg->type == MOA_BINDERLIKE_MSG_TYPE_DATA)
+			return msg;
+		smp_store_release(&msg->state, MOA_BINDERLIKE_MSG_READY);
+	}
+
+	return NULL;
+}
+
+/* post data under key, replacing its pending msg on conflating chans */
+int moa_binderlike_chan_post_key(struct moa_binderlike_chan *chan,
+				 unsigned int key, const void *data, size_t len)
+{
+	struct moa_binderlike_msg *msg = NULL;
+
+	if (!chan || !data || len > sizeof(msg->content))
+		return -ENOSPC;
+
+	if (key && (READ_ONCE(chan->sq.q->flags) & MOA_BINDERLIKE_QUEUE_CONFLATE))
+		msg = moa_binderlike_chan_conflate(chan, key);
+
+	if (!msg) {
+		msg = moa_binderlike_chan_reserve(chan);
+		if (IS_ERR(msg))
+			return PTR_ERR(msg);
+		msg->key = key;
+	}
+
+	memcpy(msg->content, data, len);
+	msg->len = len;
+	moa_binderlike_chan_commit(chan, msg);
+	return len;
+}
+EXPORT_SYMBOL(moa_binderlike_chan_post_key);
+
+int moa_binderlike_chan_post(struct moa_binderlike_chan *chan,
+			     const void *data, size_t len)
+{
+	struct moa_binderlike_msg *msg;
+
+	if (!data || len > sizeof(msg->content))
+		return -ENOSPC;
+
+	msg = moa_binderlike_chan_reserve(chan);
+	if (IS_ERR(msg))
+		return PTR_ERR(msg);
+
+	memcpy(msg->content, data, len);
+	msg->len = len;
+	moa_binderlike_chan_commit(chan, msg);
+	return len;
+}
+EXPORT_SYMBOL(moa_binderlike_chan_post);
+
+/* the chan takes its own reference on dmabuf */
+static int moa_binderlike_dmabuf_add(struct moa_binderlike_chan *chan,
+				     struct dma_buf *dmabuf)
+{
+	unsigned long flags;
+	int handle;
+
+	spin_lock_irqsave(&chan->dmabuf_lock, flags);
+	if (chan->dmabuf_cnt >= BINDERLIKE_DMABUF_MAX) {
+		spin_unlock_irqrestore(&chan->dmabuf_lock, flags);
+		return -ENOSPC;
+	}
+
+	handle = idr_alloc(&chan->dmabuf_idr, dmabuf, 1, 0, GFP_ATOMIC);
+	if (handle > 0) {
+		get_dma_buf(dmabuf);
+		chan->dmabuf_cnt++;
+	}
+	spin_unlock_irqrestore(&chan->dmabuf_lock, flags);
+
+	return handle;
+}
+
+/* hands the chan's reference over to the caller */
+struct dma_buf *moa_binderlike_chan_take_dmabuf(struct moa_binderlike_chan *chan,
+						int handle)
+{
+	struct dma_buf *dmabuf;
+	unsigned long flags;
+
+	if (!chan || handle <= 0)
+		return NULL;
+
+	spin_lock_irqsave(&chan->dmabuf_lock, flags);
+	dmabuf = idr_remove(&chan->dmabuf_idr, handle);
+	if (dmabuf)
+		chan->dmabuf_cnt--;
+	spin_unlock_irqrestore(&chan->dmabuf_lock, flags);
+
+	return dmabuf;
+}
+EXPORT_SYMBOL(moa_binderlike_chan_take_dmabuf);
+
+static void moa_binderlike_dmabuf_drop(struct moa_binderlike_chan *chan,
+				       const struct moa_binderlike_msg *msg)
+{
+	struct dma_buf *dmabuf;
+
+	if (msg->type != MOA_BINDERLIKE_MSG_TYPE_DMABUF)
+		return;
+
+	dmabuf = moa_binderlike_chan_take_dmabuf(chan, msg->handle);
+	if (dmabuf)
+		dma_buf_put(dmabuf);
+}
+
+/* give back the blocks of an ARENA entry, the consumer is done with them */
+static void moa_binderlike_arena_release(struct moa_binderlike_chan *chan,
+					 const struct moa_binderlike_msg *msg)
+{
+	struct moa_binderlike_arena *arena = chan->arena;
+	unsigned int off, len, blk, cnt, mask;
+
+	if (msg->type != MOA_BINDERLIKE_MSG_TYPE_ARENA || !arena)
+		return;
+
+	/* the header is user writable, only our own geometry is trusted */
+	off = READ_ONCE(msg->arena_off);
+	len = READ_ONCE(msg->arena_len);
+	blk = off / BINDERLIKE_ARENA_BLK_SIZE;
+	cnt = DIV_ROUND_UP(len, BINDERLIKE_ARENA_BLK_SIZE);
+	if (!cnt || cnt > BINDERLIKE_ARENA_BLK_RUN ||
+	    blk % 32 + cnt > 32 || blk + cnt > chan->arena_blk_cnt) {
+		log_err("bad arena ref %u+%u\n", off, len);
+		return;
+	}
+
+	mask = (cnt == 32 ? ~0U : (1U << cnt) - 1) << (blk % 32);
+	moa_binderlike_fetch_andnot((volatile int *)&arena->bitmap[blk / 32],
+				    mask);
+}
+
+static int moa_binderlike_dmabuf_put_one(int handle, void *p, void *data)
+{
+	dma_buf_put(p);
+	return 0;
+}
+
+static void moa_binderlike_qos_refill(struct moa_binderlike_fh *fh, u64 now)
+{
+	u64 cap = (u64)fh->qos.burst * NSEC_PER_SEC;
+	u64 elapsed = now - fh->refill_ns;
+
+	fh->refill_ns = now;
+	if (elapsed >= div_u64(cap, fh->qos.rate)) {
+		fh->tokens = cap;
+		return;
+	}
+	fh->tokens = min(cap, fh->tokens + elapsed * fh->qos.rate);
+}
+
+/* sq slots the other producers have reserved but not filled yet */
+static unsigned int moa_binderlike_qos_held(struct moa_binderlike_chan *chan,
+					    struct moa_binderlike_fh *fh,
+					    unsigned int *used,
+					    unsigned int *own)
+{
+	unsigned int inflight[BINDERLIKE_PRODUCER_MAX + 1] = { 0 };
+	struct moa_binderlike_queue *q = chan->sq.q;
+	struct moa_binderlike_fh *p;
+	unsigned int id, held = 0, n = 0;
+	u32 idx, tail;
+
+	/* the reserve that follows fails on the same indexes */
+	if (!moa_binderlike_queue_load(&chan->sq, &idx, &tail))
+		idx = tail = 0;
+
+	for (; idx != tail; idx = (idx + 1) % chan->sq.cache_cnt, n++) {
+		id = READ_ONCE(q->msgs[idx].producer);
+		if (id <= BINDERLIKE_PRODUCER_MAX)
+			inflight[id]++;
+	}
+
+	list_for_each_entry(p, &chan->qos_list, qos_node) {
+		id = p->qos.producer;
+		if (p != fh && p->qos.reserved > inflight[id])
+			held += p->qos.reserved - inflight[id];
+	}
+
+	*used = n;
+	*own = inflight[fh->qos.producer];
+	return held;
+}
+
+/*
+ * Reserve the sq slot of a msg fh posts to chan through the driver. A file
+ * with admission set up on chan is admitted first, see struct
+ * moa_binderlike_qos; check and reserve share qos_lock, so two files can
+ * never both take the last shared slot. Other files are not accounted.
+ */
+static struct moa_binderlike_msg *
+moa_binderlike_file_reserve(struct moa_binderlike_fh *fh,
+			    struct moa_binderlike_chan *chan, bool nonblock)
+{
+	struct moa_binderlike_msg *msg;
+	unsigned int used, own, held;
+	u64 wait_ns;
+	ktime_t to;
+
+	if (!fh || fh->chan != chan || !fh->qos.producer)
+		return moa_binderlike_chan_reserve(chan);
+
+	for (;;) {
+		msg = NULL;
+		wait_ns = 0;
+		spin_lock(&chan->qos_lock);
+		if (fh->qos.rate) {
+			moa_binderlike_qos_refill(fh, ktime_get_ns());
+			if (fh->tokens < NSEC_PER_SEC)
+				wait_ns = div_u64(NSEC_PER_SEC - fh->tokens +
+						  fh->qos.rate - 1,
+						  fh->qos.rate);
+		}
+
+		if (!wait_ns) {
+			held = moa_binderlike_qos_held(chan, fh, &used, &own);
+			if (own >= fh->qos.reserved &&
+			    chan->sq.cache_cnt - 1 - used <= held) {
+				fh->qos.rejected++;
+				msg = ERR_PTR(-EBUSY);
+			} else {
+				msg = moa_binderlike_chan_reserve(chan);
+			}
+
+			/* counted as ours by the next check right away */
+			if (!IS_ERR(msg)) {
+				msg->producer = fh->qos.producer;
+				if (fh->qos.rate)
+					fh->tokens -= NSEC_PER_SEC;
+				fh->qos.admitted++;
+			}
+		} else if (nonblock) {
+			fh->qos.throttled++;
+			msg = ERR_PTR(-EAGAIN);
+		} else {
+			fh->qos.delayed++;
+		}
+		spin_unlock(&chan->qos_lock);
+
+		if (msg)
+			return msg;
+
+		/* sleep to the next token, then compete for it again */
+		to = ns_to_ktime(wait_ns);
+		set_current_state(TASK_INTERRUPTIBLE);
+		schedule_hrtimeout(&to, HRTIMER_MODE_REL);
+		if (signal_pending(current))
+			return ERR_PTR(-ERESTARTSYS);
+	}
+}
+
+/*
+ * Post a msg carrying dmabuf. The receiver claims it by the entry's handle,
+ * from userspace with MOA_BINDERIOC_RECV_DMABUF.
+ */
+static int moa_binderlike_chan_post_dmabuf_as(struct moa_binderlike_chan *chan,
+					      struct moa_binderlike_fh *fh,
+					      struct dma_buf *dmabuf,
+					      const void *data, size_t len,
+					      bool nonblock)
+{
+	struct moa_binderlike_msg *msg;
+	int handle;
+
+	if (!chan || !dmabuf || len > sizeof(msg->content))
+		return -EINVAL;
+
+	handle = moa_binderlike_dmabuf_add(chan, dmabuf);
+	if (handle < 0)
+		return handle;
+
+	msg = moa_binderlike_file_reserve(fh, chan, nonblock);
+	if (IS_ERR(msg)) {
+		dma_buf_put(moa_binderlike_chan_take_dmabuf(chan, handle));
+		return PTR_ERR(msg);
+	}
+
+	if (data && len)
+		memcpy(msg->content, data, len);
+	msg->len = len;
+	msg->type = MOA_BINDERLIKE_MSG_TYPE_DMABUF;
+	msg->handle = handle;
+	moa_binderlike_chan_commit(chan, msg);
+	return handle;
+}
+
+int moa_binderlike_chan_post_dmabuf(struct moa_binderlike_chan *chan,
+				    struct dma_buf *dmabuf,
+				    const void *data, size_t len)
+{
+	return moa_binderlike_chan_post_dmabuf_as(chan, NULL, dmabuf, data, len,
+						  false);
+}
+EXPORT_SYMBOL(moa_binderlike_chan_post_dmabuf);
+
+static int moa_binderlike_qos_set(struct moa_binderlike_fh *fh,
+				  struct moa_binderlike_qos *qos)
+{
+	struct moa_binderlike_chan *chan = fh->chan;
+	unsigned int reserved = qos->reserved;
+	struct moa_binderlike_fh *p;
+	int id, ret = 0;
+
+	spin_lock(&chan->qos_lock);
+	/* msgs enqueued through the mapped ring cannot be admitted */
+	if (fh->mapped) {
+		ret = -EPERM;
+		goto out;
+	}
+
+	list_for_each_entry(p, &chan->qos_list, qos_node) {
+		if (p != fh)
+			reserved += p->qos.reserved;
+	}
+
+	/* at least one slot stays shared by everybody */
+	if (reserved + 2 > chan->sq.cache_cnt) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	if (!fh->qos.producer) {
+		id = find_first_zero_bit(&chan->producer_ids,
+					 BINDERLIKE_PRODUCER_MAX);
+		if (id >= BINDERLIKE_PRODUCER_MAX) {
+			ret = -EBUSY;
+			goto out;
+		}
+		set_bit(id, &chan->producer_ids);
+		fh->qos.producer = id + 1;
+		list_add_tail(&fh->qos_node, &chan->qos_list);
+	}
+
+	fh->qos.rate = qos->rate;
+	fh->qos.burst = max(qos->burst, 1U);
+	fh->qos.reserved = qos->reserved;
+	fh->tokens = (u64)fh->qos.burst * NSEC_PER_SEC;
+	fh->refill_ns = ktime_get_ns();
+	*qos = fh->qos;
+out:
+	spin_unlock(&chan->qos_lock);
+	return ret;
+}
+
+static void moa_binderlike_qos_del(struct moa_binderlike_fh *fh)
+{
+	struct moa_binderlike_chan *chan = fh->chan;
+
+	if (!chan || !fh->qos.producer)
+		return;
+
+	spin_lock(&chan->qos_lock);
+	list_del_init(&fh->qos_node);
+	clear_bit(fh->qos.producer - 1, &chan->producer_ids);
+	fh->qos.producer = 0;
+	spin_unlock(&chan->qos_lock);
+}
 
 static int moa_binderlike_queue_addmsg(struct moa_binderlike_chan *chan,
-				       const char *buf, size_t len)
+				       struct moa_binderlike_fh *fh,
+				       const char *buf, size_t len,
+				       bool nonblock)
 {
-	struct moa_binderlike_chan_queue *sq;
-	struct moa_binderlike_queue *queue;
 	struct moa_binderlike_msg *msg;
-	u32 cur, new_tail;
 	size_t sz;
 
 	if (!chan) {
@@ -102,37 +865,101 @@ static int moa_binderlike_queue_addmsg(struct moa_binderlike_chan *chan,
 		return -ENOTTY;
 	}
 
-	if (!buf || len + 1 >= sizeof(sq->q->msgs[0].content)) {
+	if (!buf || len + 1 >= sizeof(msg->content)) {
 		log_err("buf %px, len %d wrong", buf, len);
 		return -ENOSPC;
 	}
 
-	sq = &chan->sq;
-	queue = sq->q;
+	msg = moa_binderlike_file_reserve(fh, chan, nonblock);
+	if (IS_ERR(msg)) {
+		log_err("no sq slot, %ld\n", PTR_ERR(msg));
+		return PTR_ERR(msg);
+	}
+
+	sz = snprintf(msg->content, sizeof(msg->content), "%s", buf);
 
-	spin_lock(&wr_spin);
+	if (sz > 0 && msg->content[sz - 1] == '\n')
+		msg->content[--sz] = '\0';
+	msg->len = sz;
 
-	cur = queue->tail;
-	new_tail = (queue->tail + 1) % sq->cache_cnt;
+	moa_binderlike_chan_commit(chan, msg);
 
-	if (queue->head % sq->cache_cnt == new_tail) {
-		log_err("submit queue is full\n");
-		spin_unlock(&wr_spin);
-		return -EBUSY;
+	log_dbg("add msg size %d, current head %d [%s]\n", sz,
+		chan->sq.q->head, msg->content);
+	return sz;
+}
+
+/* tell the sq producer its msg was dropped, best effort */
+static void moa_binderlike_chan_notify_expired(struct moa_binderlike_chan *chan,
+					       const struct moa_binderlike_msg *msg)
+{
+	struct moa_binderlike_msg *done;
+
+	done = moa_binderlike_queue_reserve(&chan->cq);
+	if (IS_ERR(done)) {
+		log_dbg("cq is full, expired msg %u not reported\n", msg->key);
+		return;
 	}
 
-	queue->tail = new_tail;
-	spin_unlock(&wr_spin);
+	done->type = MOA_BINDERLIKE_MSG_TYPE_EXPIRED;
+	done->key = msg->key;
+	done->deadline_ns = msg->deadline_ns;
+	done->len = min_t(unsigned int, msg->len, sizeof(done->content));
+	memcpy(done->content, msg->content, done->len);
+	smp_store_release(&done->state, MOA_BINDERLIKE_MSG_READY);
+}
 
-	msg = &queue->msgs[cur];
-	sz = snprintf(msg->content, sizeof(msg->content), "%s", buf);
+/*
+ * Drop the run of expired entries at head with one head update, so a
+ * consumer back from a stall does not churn through stale msgs.
+ */
+static int moa_binderlike_queue_skip_expired(struct moa_binderlike_chan *chan)
+{
+	struct moa_binderlike_queue *q = chan->sq.q;
+	struct moa_binderlike_msg *msg;
+	u64 deadline, now = 0;
+	u32 cur, tail;
+	int cnt = 0;
 
-	if (msg->content[sz - 1] == '\n')
-		msg->content[sz - 1] = '\0';
+	if (!moa_binderlike_queue_load(&chan->sq, &cur, &tail))
+		return 0;
 
-	log_dbg("add msg to slot %d, size %d, current head %d [%s]\n", cur, sz,
-		queue->head, msg->content);
-	return sz;
+	while (cur != tail) {
+		msg = &q->msgs[cur];
+		if (smp_load_acquire(&msg->state) != MOA_BINDERLIKE_MSG_READY)
+			break;
+
+		deadline = READ_ONCE(msg->deadline_ns);
+		if (!deadline)
+			break;
+		if (!now)
+			now = ktime_get_ns();
+		if (deadline > now || !moa_binderlike_queue_claim(q, cur))
+			break;
+
+		/* a conflating producer may have refreshed it before the claim */
+		if (!msg->deadline_ns || msg->deadline_ns > now) {
+			smp_store_release(&msg->state, MOA_BINDERLIKE_MSG_READY);
+			break;
+		}
+
+		if (msg->flags & MOA_BINDERLIKE_MSG_F_NOTIFY_EXPIRED)
+			moa_binderlike_chan_notify_expired(chan, msg);
+		moa_binderlike_dmabuf_drop(chan, msg);
+		moa_binderlike_arena_release(chan, msg);
+
+		WRITE_ONCE(msg->state, MOA_BINDERLIKE_MSG_FREE);
+		cur = (cur + 1) % chan->sq.cache_cnt;
+		cnt++;
+	}
+
+	if (!cnt)
+		return 0;
+
+	smp_store_release(&q->head, cur);
+	WRITE_ONCE(q->expired, q->expired + cnt);
+	log_dbg("chan %d dropped %d expired msgs\n", chan->chan_id, cnt);
+	return cnt;
 }
 
 int moa_binderlike_queue_getmsg(struct moa_binderlike_chan *chan, char *buf,
@@ -153,25 +980,240 @@ int moa_binderlike_queue_getmsg(struct moa_binderlike_chan *chan, char *buf,
 	}
 
 	q = chan->sq.q;
-	if (q->head == q->tail) {
-		log_err("submit queue is empty\n");
+	moa_binderlike_queue_skip_expired(chan);
+	if (!moa_binderlike_queue_pending(&chan->sq, &cur)) {
+		log_dbg("submit queue is empty\n");
+		return -ENOMEM;
+	}
+
+	if (!moa_binderlike_queue_claim(q, cur)) {
+		log_dbg("head entry is being rewritten\n");
 		return -ENOMEM;
 	}
 
-	sz = snprintf(buf, len, "%s", q->msgs[q->head].content);
+	/* content is not terminated, a full record fills the whole slot */
+	sz = min_t(size_t, READ_ONCE(q->msgs[cur].len),
+		   sizeof(q->msgs[cur].content));
+	sz = min(sz, len - 1);
+	memcpy(buf, q->msgs[cur].content, sz);
+	buf[sz] = '\0';
 
 	if (sz > 0 && buf[sz - 1] == '\n')
-		buf[sz - 1] = '\0';
+		buf[--sz] = '\0';
 
+	/* read() cannot pass an fd nor a payload, release what it carried */
+	moa_binderlike_dmabuf_drop(chan, &q->msgs[cur]);
+	moa_binderlike_arena_release(chan, &q->msgs[cur]);
 
-	cur = (q->head + 1) % chan->sq.cache_cnt;
-	q->head = cur;
+	/* hand the slot back before producers can see the new head */
+	WRITE_ONCE(q->msgs[cur].state, MOA_BINDERLIKE_MSG_FREE);
+	smp_store_release(&q->head, (cur + 1) % chan->sq.cache_cnt);
 
 	log_dbg("head %d - 1 have been read, [%s]\n", q->head, buf);
 
 	return sz;
 }
 
+static void *moa_binderlike_chan_alloc_mem(struct moa_binderlike_chan *chan,
+					   unsigned int size)
+{
+	unsigned int i = 0, nr_pages = size >> PAGE_SHIFT;
+	struct page *page;
+	void *vaddr;
+
+	chan->shm = shmem_file_setup("moa_binderlike_chan", size, VM_NORESERVE);
+	if (IS_ERR(chan->shm)) {
+		chan->shm = NULL;
+		return NULL;
+	}
+
+	/* the kernel keeps the ring mapped, never let it be swapped out */
+	mapping_set_unevictable(chan->shm->f_mapping);
+
+	chan->pages = kcalloc(nr_pages, sizeof(*chan->pages), GFP_KERNEL);
+	if (!chan->pages)
+		goto put_file;
+
+	for (i = 0; i < nr_pages; i++) {
+		page = shmem_read_mapping_page(chan->shm->f_mapping, i);
+		if (IS_ERR(page))
+			goto put_pages;
+		chan->pages[i] = page;
+	}
+
+	vaddr = vmap(chan->pages, nr_pages, VM_MAP, PAGE_KERNEL);
+	if (!vaddr)
+		goto put_pages;
+
+	return vaddr;
+
+put_pages:
+	while (i--)
+		put_page(chan->pages[i]);
+	kfree(chan->pages);
+	chan->pages = NULL;
+put_file:
+	fput(chan->shm);
+	chan->shm = NULL;
+	return NULL;
+}
+
+static void moa_binderlike_chan_free_mem(struct moa_binderlike_chan *chan)
+{
+	unsigned int i, nr_pages = chan->memblk_size >> PAGE_SHIFT;
+
+	if (!chan->shm)
+		return;
+
+	/* the sq's q addr is the start of the ring memory */
+	vunmap(chan->sq.q);
+	for (i = 0; i < nr_pages; i++)
+		put_page(chan->pages[i]);
+	kfree(chan->pages);
+	fput(chan->shm);
+	chan->shm = NULL;
+}
+
+static void moa_binderlike_consume_work(struct work_struct *work)
+{
+	struct moa_binderlike_chan *chan =
+		container_of(work, struct moa_binderlike_chan, consume_work);
+	struct moa_binderlike_queue *q = chan->sq.q;
+	/* pairs with the release in register, priv is valid with fn */
+	moa_binderlike_consume_fn fn = smp_load_acquire(&chan->consume_fn);
+	void *priv = chan->consume_priv;
+	u32 cur;
+
+	if (!fn)
+		return;
+
+	/* leaves the kernel sleeper bit set, so producers kick us again */
+	for (;;) {
+		moa_binderlike_queue_skip_expired(chan);
+		if (!moa_binderlike_chan_ready_at(chan, &cur))
+			break;
+
+		/* a conflating producer rewriting it kicks us once done */
+		if (!moa_binderlike_queue_claim(q, cur))
+			break;
+
+		fn(chan, &q->msgs[cur], priv);
+		/* a dma-buf the consumer did not take is released */
+		moa_binderlike_dmabuf_drop(chan, &q->msgs[cur]);
+		moa_binderlike_arena_release(chan, &q->msgs[cur]);
+
+		WRITE_ONCE(q->msgs[cur].state, MOA_BINDERLIKE_MSG_FREE);
+		smp_store_release(&q->head, (cur + 1) % chan->sq.cache_cnt);
+	}
+}
+
+static void moa_binderlike_chan_release(struct kref *ref)
+{
+	struct moa_binderlike_chan *chan =
+		container_of(ref, struct moa_binderlike_chan, ref);
+
+	hrtimer_cancel(&chan->notify_timer);
+	cancel_work_sync(&chan->consume_work);
+
+	/* dma-bufs nobody claimed go with the chan */
+	idr_for_each(&chan->dmabuf_idr, moa_binderlike_dmabuf_put_one, NULL);
+	idr_destroy(&chan->dmabuf_idr);
+
+	moa_binderlike_chan_free_mem(chan);
+	kfree(chan);
+}
+
+/* look a chan up by id, safe from atomic and irq context */
+struct moa_binderlike_chan *moa_binderlike_chan_get(int chan_id)
+{
+	struct moa_binderlike_chan *chan = NULL;
+	unsigned long flags;
+
+	if (!g_bdev || chan_id < 0 || chan_id >= BINDERLIKE_CHAN_MAX)
+		return NULL;
+
+	spin_lock_irqsave(&g_bdev->chan_lock, flags);
+	chan = g_bdev->chan_map[chan_id];
+	if (chan)
+		kref_get(&chan->ref);
+	spin_unlock_irqrestore(&g_bdev->chan_lock, flags);
+
+	return chan;
+}
+EXPORT_SYMBOL(moa_binderlike_chan_get);
+
+/* the last put frees the ring, so it must come from process context */
+void moa_binderlike_chan_put(struct moa_binderlike_chan *chan)
+{
+	might_sleep();
+	if (chan)
+		kref_put(&chan->ref, moa_binderlike_chan_release);
+}
+EXPORT_SYMBOL(moa_binderlike_chan_put);
+
+/*
+ * Let a module consume the chan's sq. fn runs from a workqueue, once per
+ * msg, and must not keep msg after returning. Userspace must not dequeue
+ * from a chan with a kernel consumer.
+ */
+int moa_binderlike_chan_register_consumer(struct moa_binderlike_chan *chan,
+					  moa_binderlike_consume_fn fn,
+					  void *priv)
+{
+	if (!chan || !fn)
+		return -EINVAL;
+
+	/* a losing caller must not touch the registered consumer's priv */
+	if (test_and_set_bit(0, &chan->consume_busy))
+		return -EBUSY;
+
+	chan->consume_priv = priv;
+	smp_store_release(&chan->consume_fn, fn);
+
+	/* drain what is already queued and arm the sleeper bit */
+	queue_work(system_highpri_wq, &chan->consume_work);
+	return 0;
+}
+EXPORT_SYMBOL(moa_binderlike_chan_register_consumer);
+
+void moa_binderlike_chan_unregister_consumer(struct moa_binderlike_chan *chan)
+{
+	if (!chan)
+		return;
+
+	WRITE_ONCE(chan->consume_fn, NULL);
+	cancel_work_sync(&chan->consume_work);
+	chan->consume_priv = NULL;
+	clear_bit(0, &chan->consume_busy);
+}
+EXPORT_SYMBOL(moa_binderlike_chan_unregister_consumer);
+
+static void moa_binderlike_unregister_chan(struct moa_binderlike_device *bdev,
+					   struct moa_binderlike_chan *chan)
+{
+	unsigned long flags;
+	bool mapped;
+
+	mutex_lock(&bdev->chan_mutex);
+	spin_lock_irqsave(&bdev->chan_lock, flags);
+	mapped = chan->chan_id >= 0 && bdev->chan_map[chan->chan_id] == chan;
+	if (mapped)
+		bdev->chan_map[chan->chan_id] = NULL;
+	list_del_init(&chan->chan_node);
+	spin_unlock_irqrestore(&bdev->chan_lock, flags);
+
+	/* the next chan of this id starts out idle */
+	if (mapped && bdev->ready)
+		moa_binderlike_fetch_andnot((volatile int *)&bdev->ready->bits,
+					    BIT(chan->chan_id));
+
+	/* open files of the node keep their chan until they are closed */
+	if (mapped)
+		device_destroy(moa_binderlike_class,
+			       bdev->devt + chan->chan_id + 1);
+	mutex_unlock(&bdev->chan_mutex);
+}
+
 static void bind_chan_and_fh(struct moa_binderlike_chan *chan, struct moa_binderlike_fh *fh)
 {
 	fh->chan = chan;
@@ -194,6 +1236,21 @@ static void unbind_chan_and_fh(struct moa_binderlike_chan *chan, struct moa_bind
 int moa_binderlike_open(struct inode *inode, struct file *filp)
 {
 	struct moa_binderlike_fh *fh = kzalloc(sizeof(*fh), GFP_KERNEL);
+	unsigned int minor = iminor(inode) - MINOR(g_bdev->devt);
+
+	if (!fh)
+		return -ENOMEM;
+	INIT_LIST_HEAD(&fh->qos_node);
+
+	/* a chan node binds its file once, later ops need no lookup */
+	if (minor) {
+		fh->chan = moa_binderlike_chan_get(minor - 1);
+		if (!fh->chan) {
+			kfree(fh);
+			return -ENODEV;
+		}
+	}
+
 	filp->private_data = fh;
 	return 0;
 }
@@ -209,99 +1266,207 @@ int moa_binderlike_frelease(struct inode *inode, struct file *filp)
 	if (!chan)
 		goto fh_out;
 
-	/* the sq's q addr is eq to cpu addr */
-	dma_free_coherent(&g_bdev->pdev->dev, chan->memblk_size, chan->sq.q,
-			  chan->dma_addr);
-	kfree(fh->chan);
+	moa_binderlike_qos_del(fh);
+
+	/* in-kernel clients and chan node files may still hold the chan */
+	if (fh->owner)
+		moa_binderlike_unregister_chan(g_bdev, chan);
+	moa_binderlike_chan_put(chan);
+	fh->chan = NULL;
 fh_out:
 	kfree(fh);
 	return 0;
 }
 
+/* the chan a file op works on, put it once the op is done */
+static struct moa_binderlike_chan *moa_binderlike_file_chan(struct file *filp)
+{
+	struct moa_binderlike_fh *fh = filp->private_data;
+
+	if (fh && fh->chan) {
+		kref_get(&fh->chan->ref);
+		return fh->chan;
+	}
+
+	/* in debug mode, files without their own chan use chan 0 */
+	return moa_binderlike_chan_get(0);
+}
+
 ssize_t moa_binderlike_read(struct file *filp, char __user *buf, size_t len,
 			    loff_t *offset)
 {
-	size_t sz;
+	ssize_t sz;
 	char sbuf[256];
 	struct moa_binderlike_chan *chan;
 
-	chan = g_bdev->chan_map[0];
+	chan = moa_binderlike_file_chan(filp);
 	if (!chan) {
 		log_err("chan is not inited\n");
 		return -ENODEV;
 	}
 
+	if (!(filp->f_flags & O_NONBLOCK)) {
+		sz = wait_event_interruptible(chan->wq,
+					      moa_binderlike_chan_ready(chan));
+		if (sz)
+			goto out;
+	}
+
 	sz = moa_binderlike_queue_getmsg(chan, sbuf, sizeof(sbuf));
 
 	if (sz <= 0)
-		return sz;
-	return copy_to_user(buf, sbuf, sizeof(sbuf));
+		goto out;
+
+	len = min_t(size_t, len, sz + 1);
+	sz = copy_to_user(buf, sbuf, len) ? -EFAULT : len;
+out:
+	moa_binderlike_chan_put(chan);
+	return sz;
 }
 
 ssize_t moa_binderlike_write(struct file *filp, const char __user *buf,
 			     size_t len, loff_t *offset)
 {
-	int ret = 0;
 	char sbuf[256];
+	struct moa_binderlike_fh *fh = filp->private_data;
 	struct moa_binderlike_chan *chan;
+	ssize_t ret;
 
 	if (len + 1 >= sizeof(sbuf)) {
 		log_err("msg size %d is too long", len);
 		return -EFAULT;
 	}
 
-	/* in debug mode, we just use chan 0 */
-	chan = g_bdev->chan_map[0];
+	chan = moa_binderlike_file_chan(filp);
 	if (!chan) {
 		log_err("chan is not init\n");
 		return -ENODEV;
 	}
 
-	if (copy_from_user(sbuf, buf, sizeof(sbuf))) {
+	if (copy_from_user(sbuf, buf, len)) {
 		log_err("copy buffer from userspace failed\n");
-		return ret;
+		ret = -EFAULT;
+		goto out;
 	}
 
 	sbuf[len] = '\0';
 
-	return moa_binderlike_queue_addmsg(chan, sbuf, len);
+	ret = moa_binderlike_queue_addmsg(chan, fh, sbuf, len,
+					  filp->f_flags & O_NONBLOCK);
+out:
+	moa_binderlike_chan_put(chan);
+	return ret;
+}
+
+static int moa_binderlike_mmap_ready(struct vm_area_struct *vma)
+{
+	if (!g_bdev->ready_page)
+		return -ENODEV;
+
+	if (vma->vm_end - vma->vm_start > PAGE_SIZE) {
+		log_err("ready page mmap size %lu is too large\n",
+			vma->vm_end - vma->vm_start);
+		return -EINVAL;
+	}
+
+	return vm_insert_page(vma, vma->vm_start, g_bdev->ready_page);
 }
 
 static int moa_binderlike_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-	struct moa_binderlike_fh *fh =
-		(struct moa_binderlike_fh *)filp->private_data;
-	struct moa_binderlike_chan *chan = fh->chan;
+	struct moa_binderlike_fh *fh = filp->private_data;
+	struct moa_binderlike_chan *chan;
+	size_t mmap_area_sz;
+	int ret = 0;
 
-	size_t mmap_area_sz = PAGE_ALIGN(chan->memblk_size);
-	pgprot_t prot = pgprot_noncached(vma->vm_page_prot);
+	if (vma->vm_pgoff == MOA_BINDERLIKE_READY_MMAP_OFF >> PAGE_SHIFT)
+		return moa_binderlike_mmap_ready(vma);
+
+	chan = moa_binderlike_file_chan(filp);
+	if (!chan) {
+		log_err("chan is not init\n");
+		return -ENODEV;
+	}
 
+	mmap_area_sz = PAGE_ALIGN(chan->memblk_size);
 	if (vma->vm_end - vma->vm_start > mmap_area_sz) {
 		log_err("mmap size %lu is too large to map\n",
 			vma->vm_end - vma->vm_start);
-		return -EINVAL;
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* a file under admission must go through write or SEND_DMABUF */
+	if (fh && fh->chan == chan) {
+		spin_lock(&chan->qos_lock);
+		if (fh->qos.producer)
+			ret = -EPERM;
+		else
+			fh->mapped = true;
+		spin_unlock(&chan->qos_lock);
+		if (ret < 0) {
+			log_err("chan %d has qos set on this file, no mmap\n",
+				chan->chan_id);
+			goto out;
+		}
 	}
 
-	if (remap_pfn_range(vma, vma->vm_start, chan->dma_addr >> PAGE_SHIFT,
-			    vma->vm_end - vma->vm_start, prot) < 0)
-		return -EAGAIN;
+	/*
+	 * hand the vma over to the shmem file backing the ring, shared
+	 * futexes only work on page cache backed memory
+	 */
+	ret = call_mmap(chan->shm, vma);
+	if (ret < 0)
+		goto out;
+
+	/* the vma keeps the shmem file, not the chan */
+	fput(vma->vm_file);
+	vma->vm_file = get_file(chan->shm);
+out:
+	moa_binderlike_chan_put(chan);
+	return ret;
+}
+
+static __poll_t moa_binderlike_poll(struct file *filp, poll_table *wait)
+{
+	struct moa_binderlike_fh *fh = filp->private_data;
+	struct moa_binderlike_chan *chan = fh ? fh->chan : NULL;
+
+	/*
+	 * the poll table outlives this call, only a chan the file holds
+	 * until release can be waited on, no debug fallback here
+	 */
+	if (!chan)
+		return EPOLLERR;
 
+	poll_wait(filp, &chan->wq, wait);
+	if (moa_binderlike_chan_ready(chan))
+		return EPOLLIN | EPOLLRDNORM;
 	return 0;
 }
 
 static inline unsigned int
 cal_binderlike_entry_size(const struct moa_binderlike_arg_table *table)
 {
-	unsigned int entry_len = 0, i;
+	/* every entry starts with its slot state */
+	unsigned int entry_len = offsetof(struct moa_binderlike_msg, content), i;
 	for (i = 0; i < table->argc && i < BINDERLIKE_INPUT_PARAM_MAX; i++) {
 		entry_len += table->arg_size[i];
 	}
 	return entry_len;
 }
 
+static inline unsigned int
+cal_binderlike_arena_hdr_size(unsigned int blk_cnt)
+{
+	return PAGE_ALIGN(sizeof(struct moa_binderlike_arena) +
+			  DIV_ROUND_UP(blk_cnt, 32) * sizeof(u32));
+}
+
 static unsigned int
 cal_binderlike_chan_size(const struct moa_binderlike_chan_info *info,
-			 unsigned int *cq_offset)
+			 unsigned int *cq_offset, unsigned int *capture_offset,
+			 unsigned int *arena_offset)
 {
 	unsigned int sz_queue = 0, sz_total = 0;
 	unsigned int sz_entry = cal_binderlike_entry_size(&info->sq_info);
@@ -320,12 +1485,47 @@ cal_binderlike_chan_size(const struct moa_binderlike_chan_info *info,
 	sz_queue = ALIGN(sz_queue, sizeof(dma_addr_t));
 	sz_total += sz_queue;
 
+	/* calculate capture ring size, records are whole msgs */
+	*capture_offset = 0;
+	if (info->capture_cnt) {
+		*capture_offset = sz_total;
+		sz_queue = sizeof(struct moa_binderlike_queue) +
+			   sizeof(struct moa_binderlike_msg) * info->capture_cnt;
+		sz_total += ALIGN(sz_queue, sizeof(dma_addr_t));
+	}
+
+	/* calculate arena size, its blocks are page aligned in the mmap */
+	*arena_offset = 0;
+	if (info->arena_sz) {
+		sz_total = PAGE_ALIGN(sz_total);
+		*arena_offset = sz_total;
+		sz_total += cal_binderlike_arena_hdr_size(
+			info->arena_sz / BINDERLIKE_ARENA_BLK_SIZE);
+		sz_total += info->arena_sz;
+	}
+
 	return sz_total;
 }
 
+static void moa_binderlike_arena_init(struct moa_binderlike_arena *arena,
+				      unsigned int arena_sz)
+{
+	unsigned int blk_cnt = arena_sz / BINDERLIKE_ARENA_BLK_SIZE;
+
+	arena->blk_size = BINDERLIKE_ARENA_BLK_SIZE;
+	arena->blk_cnt = blk_cnt;
+	arena->data_offset = cal_binderlike_arena_hdr_size(blk_cnt);
+
+	/* the tail of the last word has no blocks behind it */
+	if (blk_cnt % 32)
+		arena->bitmap[blk_cnt / 32] = ~((1U << (blk_cnt % 32)) - 1);
+}
+
 static int moa_binderlike_register_chan(struct moa_binderlike_device *bdev,
 					struct moa_binderlike_chan *chan)
 {
+	struct device *dev;
+	unsigned long flags;
 	int i;
 	if (!bdev)
 		return -ENODEV;
@@ -333,20 +1533,31 @@ static int moa_binderlike_register_chan(struct moa_binderlike_device *bdev,
 	if (chan->chan_id >= 0)
 		return -EBUSY;
 
+	mutex_lock(&bdev->chan_mutex);
+	spin_lock_irqsave(&bdev->chan_lock, flags);
 	for (i = 0; i < ARRAY_SIZE(bdev->chan_map); i++) {
 		if (bdev->chan_map[i] == NULL)
 			break;
 	}
 
 	if (i == ARRAY_SIZE(bdev->chan_map)) {
+		spin_unlock_irqrestore(&bdev->chan_lock, flags);
+		mutex_unlock(&bdev->chan_mutex);
 		log_err("no available chan id\n");
 		return -EBUSY;
 	}
 
-	log_info("register chan as id %u\n", i);
 	chan->chan_id = i;
 	bdev->chan_map[i] = chan;
 	list_add_tail(&chan->chan_node, &bdev->chan_head);
+	spin_unlock_irqrestore(&bdev->chan_lock, flags);
+
+	log_info("register chan as id %u\n", i);
+	dev = device_create(moa_binderlike_class, &bdev->pdev->dev,
+			    bdev->devt + i + 1, NULL, BINDERLIKE_CHAN_NODE, i);
+	if (IS_ERR(dev))
+		log_err("chan %d node not created, %ld\n", i, PTR_ERR(dev));
+	mutex_unlock(&bdev->chan_mutex);
 	return 0;
 }
 
@@ -376,11 +1587,35 @@ static int moa_binderlike_acquire_chan(struct moa_binderlike_chan_info *info,
         return 0;
 }
 
+/* what a process needs to map a chan it did not create */
+static void moa_binderlike_chan_get_info(struct moa_binderlike_chan *chan,
+					 struct moa_binderlike_chan_info *info)
+{
+	struct moa_binderlike_arena *arena = chan->arena;
+	void *base = chan->sq.q;
+
+	info->id = chan->chan_id;
+	info->cache_cnt = chan->sq.cache_cnt;
+	info->mmap_sz = chan->memblk_size;
+	info->cq_offset = (void *)chan->cq.q - base;
+	info->coalesce_cnt = READ_ONCE(chan->sq.q->coalesce_cnt);
+	info->coalesce_us = READ_ONCE(chan->sq.q->coalesce_us);
+	info->arena_sz = chan->arena_blk_cnt * BINDERLIKE_ARENA_BLK_SIZE;
+	info->arena_offset = arena ? (void *)arena - base : 0;
+	info->flags = 0;
+	if (READ_ONCE(chan->sq.q->flags) & MOA_BINDERLIKE_QUEUE_CONFLATE)
+		info->flags |= MOA_BINDERLIKE_CHAN_CONFLATE;
+	if (!(READ_ONCE(chan->sq.q->producers) & MOA_BINDERLIKE_PRODUCER_KERNEL))
+		info->flags |= MOA_BINDERLIKE_CHAN_USER_PRODUCERS;
+	info->capture_cnt = chan->cap.q ? chan->cap.cache_cnt : 0;
+	info->capture_offset = chan->cap.q ? (void *)chan->cap.q - base : 0;
+}
+
 static int
 moa_binderlike_create_chan(struct moa_binderlike_chan_info *info, int *chan_id)
 {
 	struct moa_binderlike_chan *chan;
-	unsigned int cq_offset, sz_total;
+	unsigned int cq_offset, capture_offset, arena_offset, sz_total;
 	void *cpu_addr;
 	int ret;
 
@@ -388,39 +1623,66 @@ moa_binderlike_create_chan(struct moa_binderlike_chan_info *info, int *chan_id)
 	if (!chan)
 		return -ENOMEM;
 
-	/* alloc memory from default dma */
-	sz_total = cal_binderlike_chan_size(info, &cq_offset);
+	sz_total = cal_binderlike_chan_size(info, &cq_offset, &capture_offset,
+					    &arena_offset);
 	sz_total = PAGE_ALIGN(sz_total);
 
-	cpu_addr = dma_alloc_coherent(&g_bdev->pdev->dev, sz_total,
-				      &chan->dma_addr, GFP_KERNEL);
+	cpu_addr = moa_binderlike_chan_alloc_mem(chan, sz_total);
 
 	/* report mmap size for user app mmap */
 	if (!cpu_addr) {
-		log_err("no dma coontingous area %u for binderlike chan\n",
-			sz_total);
+		log_err("no memory %u for binderlike chan\n", sz_total);
 		ret = -ENOMEM;
 		goto clean_up;
 	}
 	chan->memblk_size = sz_total;
 
 	chan->sq.q = (struct moa_binderlike_queue *)cpu_addr;
-	chan->cq.q = (struct moa_binderlike_queue *)cpu_addr +
-		   cq_offset;
+	chan->cq.q = (struct moa_binderlike_queue *)(cpu_addr + cq_offset);
 	chan->sq.cache_cnt = info->cache_cnt;
 	chan->cq.cache_cnt = info->cache_cnt;
 
+	if (info->capture_cnt) {
+		chan->cap.q = cpu_addr + capture_offset;
+		chan->cap.cache_cnt = info->capture_cnt;
+		chan->sq.q->capture_off = capture_offset;
+		chan->sq.q->capture_cnt = info->capture_cnt;
+	}
+
+	if (info->arena_sz) {
+		chan->arena = cpu_addr + arena_offset;
+		chan->arena_blk_cnt = info->arena_sz / BINDERLIKE_ARENA_BLK_SIZE;
+		moa_binderlike_arena_init(chan->arena, info->arena_sz);
+	}
+
 	chan->chan_id = -1;
 	INIT_LIST_HEAD(&chan->chan_node);
+	init_waitqueue_head(&chan->wq);
+	hrtimer_init(&chan->notify_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	chan->notify_timer.function = moa_binderlike_notify_timer;
+	kref_init(&chan->ref);
+	INIT_WORK(&chan->consume_work, moa_binderlike_consume_work);
+	idr_init(&chan->dmabuf_idr);
+	spin_lock_init(&chan->dmabuf_lock);
+	INIT_LIST_HEAD(&chan->qos_list);
+	spin_lock_init(&chan->qos_lock);
+
+	moa_binderlike_chan_set_coalesce(chan, info->coalesce_cnt,
+					 info->coalesce_us);
+	if (info->flags & MOA_BINDERLIKE_CHAN_CONFLATE)
+		chan->sq.q->flags |= MOA_BINDERLIKE_QUEUE_CONFLATE;
+	/* set before the ring is mapped, no consumer can be on the futex yet */
+	if (!(info->flags & MOA_BINDERLIKE_CHAN_USER_PRODUCERS))
+		chan->sq.q->producers = MOA_BINDERLIKE_PRODUCER_KERNEL;
 
 	ret = moa_binderlike_register_chan(g_bdev, chan);
 	if (ret < 0) {
 		log_err("register chan to binderlike dev fail\n");
+		moa_binderlike_chan_free_mem(chan);
 		goto clean_up;
 	}
 
-	info->mmap_sz = chan->memblk_size;
-	info->cq_offset = cq_offset;
+	moa_binderlike_chan_get_info(chan, info);
 	*chan_id = chan->chan_id;
 	return ret;
 
@@ -429,6 +1691,57 @@ clean_up:
 	return ret;
 }
 
+/*
+ * Refresh the readiness bits of the chans in mask from their rings and
+ * arm their sleeper bits, so the next enqueue wakes ready_wq.
+ */
+static unsigned int moa_binderlike_scan_ready(struct moa_binderlike_device *bdev,
+					      unsigned int mask)
+{
+	struct moa_binderlike_chan *chan;
+	unsigned int ready = 0;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&bdev->chan_lock, flags);
+	for_each_set_bit(i, (unsigned long *)&mask, BINDERLIKE_CHAN_MAX) {
+		chan = bdev->chan_map[i];
+		if (chan && moa_binderlike_chan_ready(chan))
+			ready |= BIT(i);
+	}
+	spin_unlock_irqrestore(&bdev->chan_lock, flags);
+
+	/* bits of drained chans may be stale, the rings are the truth */
+	moa_binderlike_fetch_andnot((volatile int *)&bdev->ready->bits,
+				    mask & ~ready);
+	if (ready)
+		moa_binderlike_fetch_or((volatile int *)&bdev->ready->bits,
+					ready);
+	return ready;
+}
+
+static long moa_binderlike_wait_any(struct moa_binderlike_device *bdev,
+				    struct moa_binderlike_wait_any *wa)
+{
+	unsigned int mask = wa->mask & GENMASK(BINDERLIKE_CHAN_MAX - 1, 0);
+	long ret;
+
+	wa->ready = 0;
+	if (!mask || !bdev->ready)
+		return -EINVAL;
+
+	if (wa->timeout_ms < 0) {
+		ret = wait_event_interruptible(bdev->ready_wq,
+			(wa->ready = moa_binderlike_scan_ready(bdev, mask)));
+		return ret;
+	}
+
+	ret = wait_event_interruptible_timeout(bdev->ready_wq,
+		(wa->ready = moa_binderlike_scan_ready(bdev, mask)),
+		msecs_to_jiffies(wa->timeout_ms));
+	return ret < 0 ? ret : 0;
+}
+
 static void moa_binderlike_adjust_info(struct moa_binderlike_chan_info *info)
 {
 	unsigned int max_len = g_bdev->max_queue_len;
@@ -437,6 +1750,16 @@ static void moa_binderlike_adjust_info(struct moa_binderlike_chan_info *info)
 	if (info->cache_cnt > max_len)
 		info->cache_cnt = max_len;
 
+	/* a ring of one record could never hold one */
+	if (info->capture_cnt == 1)
+		info->capture_cnt = 2;
+	if (info->capture_cnt > BINDERLIKE_CAPTURE_MAX)
+		info->capture_cnt = BINDERLIKE_CAPTURE_MAX;
+
+	if (info->arena_sz > BINDERLIKE_ARENA_MAX)
+		info->arena_sz = BINDERLIKE_ARENA_MAX;
+	info->arena_sz = ALIGN(info->arena_sz, BINDERLIKE_ARENA_BLK_SIZE);
+
 	/* TODO: we just enforce arg as 1 string now for isp api chan */
 	/* remove it later */
 	info->sq_info.argc = 1;
@@ -445,8 +1768,9 @@ static void moa_binderlike_adjust_info(struct moa_binderlike_chan_info *info)
 	info->cq_info.arg_size[0] = sizeof(msg->content);
 }
 
-static long moa_binderlike_ioctl(struct file *filp, unsigned int cmd,
-				 unsigned long args)
+static long moa_binderlike_chan_ioctl(struct file *filp,
+				      struct moa_binderlike_chan *chan,
+				      unsigned int cmd, unsigned long args)
 {
 	void __user *argp = (void __user *)args;
 	struct moa_binderlike_fh *fh = filp->private_data;
@@ -456,10 +1780,14 @@ static long moa_binderlike_ioctl(struct file *filp, unsigned int cmd,
 	{
 		struct moa_binderlike_chan_info info;
 		int new_id;
-		ret = copy_from_user(&info, argp, sizeof(info));
-		if (ret < 0) {
+
+		/* chan nodes and files that own a chan cannot create one */
+		if (fh->chan)
+			return -EBUSY;
+
+		if (copy_from_user(&info, argp, sizeof(info))) {
 			log_err("copy from user failed\n");
-			return ret;
+			return -EFAULT;
 		}
 
 		moa_binderlike_adjust_info(&info);
@@ -471,14 +1799,212 @@ static long moa_binderlike_ioctl(struct file *filp, unsigned int cmd,
 			return ret;
 		}
 		fh->chan = g_bdev->chan_map[new_id];
+		fh->owner = true;
 
-		ret = copy_to_user(&argp, &info, sizeof(info));
-		if (ret < 0) {
+		if (copy_to_user(argp, &info, sizeof(info))) {
+			log_err("copy to user failed\n");
+			return -EFAULT;
+		}
+		break;
+	}
+	case MOA_BINDERIOC_GET_INFO:
+	{
+		struct moa_binderlike_chan_info info;
+
+		if (!chan)
+			return -ENODEV;
+
+		memset(&info, 0, sizeof(info));
+		moa_binderlike_adjust_info(&info);
+		moa_binderlike_chan_get_info(chan, &info);
+		if (copy_to_user(argp, &info, sizeof(info))) {
 			log_err("copy to user failed\n");
+			return -EFAULT;
+		}
+		break;
+	}
+	case MOA_BINDERIOC_WAKE:
+	{
+		int mode;
+
+		if (!chan)
+			return -ENODEV;
+
+		if (get_user(mode, (int __user *)argp)) {
+			log_err("copy from user failed\n");
+			return -EFAULT;
+		}
+
+		if (mode == MOA_BINDERLIKE_WAKE_DEFER) {
+			moa_binderlike_chan_defer(chan);
+			break;
+		}
+
+		/* the producer already took the sleeper bits from need_wakeup */
+		hrtimer_try_to_cancel(&chan->notify_timer);
+		WRITE_ONCE(chan->sq.q->unnotified, 0);
+		moa_binderlike_chan_wake(chan);
+		break;
+	}
+	case MOA_BINDERIOC_WAIT_ANY:
+	{
+		struct moa_binderlike_wait_any wa;
+
+		if (copy_from_user(&wa, argp, sizeof(wa))) {
+			log_err("copy from user failed\n");
+			return -EFAULT;
+		}
+
+		ret = moa_binderlike_wait_any(g_bdev, &wa);
+		if (ret < 0)
 			return ret;
+
+		if (copy_to_user(argp, &wa, sizeof(wa))) {
+			log_err("copy to user failed\n");
+			return -EFAULT;
 		}
 		break;
 	}
+	case MOA_BINDERIOC_SET_CAPTURE:
+	{
+
+		if (!chan)
+			return -ENODEV;
+		if (!chan->cap.q)
+			return -EINVAL;
+
+		if (args)
+			moa_binderlike_fetch_or(&chan->sq.q->flags,
+						MOA_BINDERLIKE_QUEUE_CAPTURE);
+		else
+			moa_binderlike_fetch_andnot(&chan->sq.q->flags,
+						    MOA_BINDERLIKE_QUEUE_CAPTURE);
+		break;
+	}
+	case MOA_BINDERIOC_SET_QOS:
+	{
+		struct moa_binderlike_qos qos;
+
+		/* admission is per file, on the chan it is bound to */
+		if (!fh->chan)
+			return -ENODEV;
+
+		if (copy_from_user(&qos, argp, sizeof(qos))) {
+			log_err("copy from user failed\n");
+			return -EFAULT;
+		}
+
+		ret = moa_binderlike_qos_set(fh, &qos);
+		if (ret < 0)
+			return ret;
+
+		if (copy_to_user(argp, &qos, sizeof(qos))) {
+			log_err("copy to user failed\n");
+			return -EFAULT;
+		}
+		break;
+	}
+	case MOA_BINDERIOC_GET_QOS:
+	{
+		struct moa_binderlike_qos qos;
+
+		if (!fh->chan)
+			return -ENODEV;
+
+		spin_lock(&fh->chan->qos_lock);
+		qos = fh->qos;
+		spin_unlock(&fh->chan->qos_lock);
+
+		if (copy_to_user(argp, &qos, sizeof(qos))) {
+			log_err("copy to user failed\n");
+			return -EFAULT;
+		}
+		break;
+	}
+	case MOA_BINDERIOC_SET_COALESCE:
+	{
+		struct moa_binderlike_coalesce co;
+
+		if (!chan)
+			return -ENODEV;
+
+		if (copy_from_user(&co, argp, sizeof(co))) {
+			log_err("copy from user failed\n");
+			return -EFAULT;
+		}
+
+		moa_binderlike_chan_set_coalesce(chan, co.cnt, co.us);
+		break;
+	}
+	case MOA_BINDERIOC_SEND_DMABUF:
+	{
+		struct moa_binderlike_dmabuf_msg dmsg;
+		struct dma_buf *dmabuf;
+
+		if (!chan)
+			return -ENODEV;
+
+		if (copy_from_user(&dmsg, argp, sizeof(dmsg))) {
+			log_err("copy from user failed\n");
+			return -EFAULT;
+		}
+
+		dmabuf = dma_buf_get(dmsg.fd);
+		if (IS_ERR(dmabuf))
+			return PTR_ERR(dmabuf);
+
+		ret = moa_binderlike_chan_post_dmabuf_as(chan, fh, dmabuf,
+							 dmsg.content, dmsg.len,
+							 filp->f_flags &
+							 O_NONBLOCK);
+		dma_buf_put(dmabuf);
+		if (ret < 0)
+			return ret;
+		break;
+	}
+	case MOA_BINDERIOC_RECV_DMABUF:
+	{
+		struct moa_binderlike_dmabuf_msg dmsg;
+		struct dma_buf *dmabuf;
+
+		if (!chan)
+			return -ENODEV;
+
+		if (copy_from_user(&dmsg, argp, sizeof(dmsg))) {
+			log_err("copy from user failed\n");
+			return -EFAULT;
+		}
+
+		if (dmsg.flags & MOA_BINDERLIKE_DMABUF_DROP) {
+			dmabuf = moa_binderlike_chan_take_dmabuf(chan,
+								 dmsg.handle);
+			if (!dmabuf)
+				return -ENOENT;
+			dma_buf_put(dmabuf);
+			break;
+		}
+
+		/* nothing can fail once the handle is taken and the fd live */
+		dmsg.fd = get_unused_fd_flags(O_CLOEXEC);
+		if (dmsg.fd < 0)
+			return dmsg.fd;
+
+		if (copy_to_user(argp, &dmsg, sizeof(dmsg))) {
+			log_err("copy to user failed\n");
+			put_unused_fd(dmsg.fd);
+			return -EFAULT;
+		}
+
+		dmabuf = moa_binderlike_chan_take_dmabuf(chan, dmsg.handle);
+		if (!dmabuf) {
+			put_unused_fd(dmsg.fd);
+			return -ENOENT;
+		}
+
+		/* the installed fd owns the reference the chan held */
+		fd_install(dmsg.fd, dmabuf->file);
+		break;
+	}
 	default:
 		log_err("unknown cmd %u\n", cmd);
 		break;
@@ -486,6 +2012,18 @@ static long moa_binderlike_ioctl(struct file *filp, unsigned int cmd,
 	return 0;
 }
 
+static long moa_binderlike_ioctl(struct file *filp, unsigned int cmd,
+				 unsigned long args)
+{
+	struct moa_binderlike_chan *chan = moa_binderlike_file_chan(filp);
+	long ret;
+
+	/* the chan stays around while the cmd sleeps, even if unregistered */
+	ret = moa_binderlike_chan_ioctl(filp, chan, cmd, args);
+	moa_binderlike_chan_put(chan);
+	return ret;
+}
+
 static struct file_operations binderlike_fops = {
 	.open = moa_binderlike_open,
 	.release = moa_binderlike_frelease,
@@ -494,6 +2032,7 @@ static struct file_operations binderlike_fops = {
 	.write = moa_binderlike_write,
 
 	.mmap = moa_binderlike_mmap,
+	.poll = moa_binderlike_poll,
 	.unlocked_ioctl = moa_binderlike_ioctl,
 };
 
@@ -503,7 +2042,8 @@ static int moa_binderlike_create_node(struct moa_binderlike_device *bdev)
 
 	cdev_init(&bdev->cdev, &binderlike_fops);
 
-	if (alloc_chrdev_region(&dev, 0, 1, "moa_binderlike_c") < 0) {
+	if (alloc_chrdev_region(&dev, 0, BINDERLIKE_CHAN_MAX + 1,
+				"moa_binderlike_c") < 0) {
 		log_err("no dev_t of char dev domain vaild, alloc fail\n");
 		return -EBUSY;
 	}
@@ -511,13 +2051,16 @@ static int moa_binderlike_create_node(struct moa_binderlike_device *bdev)
 	log_info("binderlike node [%d, %d] region allocated\n", MAJOR(dev),
 		 MINOR(dev));
 
-	if (cdev_add(&bdev->cdev, dev, 1) < 0) {
+	/* one cdev spans the control node and every chan node */
+	if (cdev_add(&bdev->cdev, dev, BINDERLIKE_CHAN_MAX + 1) < 0) {
 		log_err("register cdev fail\n");
+		unregister_chrdev_region(dev, BINDERLIKE_CHAN_MAX + 1);
 		return -EBUSY;
 	}
+	bdev->devt = dev;
 
 	device_create(moa_binderlike_class, &bdev->pdev->dev, dev, NULL,
-		      "moa_binderlike");
+		      BINDERLIKE_CTRL_NODE);
 	return 0;
 }
 
@@ -531,6 +2074,7 @@ static int moa_binderlike_create_default_chan(void)
 	};
 	int chan_id, ret;
 
+	moa_binderlike_adjust_info(&info);
 	ret = moa_binderlike_create_chan(&info, &chan_id);
 	if (ret < 0)
 		return ret;
@@ -557,6 +2101,17 @@ static int moa_binderlike_probe(struct platform_device *pdev)
 
 	moa_binderlike_parse_dt(bdev);
 	INIT_LIST_HEAD(&bdev->chan_head);
+	spin_lock_init(&bdev->chan_lock);
+	mutex_init(&bdev->chan_mutex);
+	init_waitqueue_head(&bdev->ready_wq);
+
+	/* one bit per chan, wait-any masks are a single word */
+	BUILD_BUG_ON(BINDERLIKE_CHAN_MAX > 32);
+	bdev->ready_page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+	if (bdev->ready_page)
+		bdev->ready = page_address(bdev->ready_page);
+	else
+		log_err("no readiness page, wait-any is disabled\n");
 
 	if (moa_binderlike_create_node(bdev) < 0)
 		goto clean_up;
@@ -567,6 +2122,8 @@ static int moa_binderlike_probe(struct platform_device *pdev)
 	return 0;
 	log_info("exit --\n");
 clean_up:
+	if (bdev->ready_page)
+		__free_page(bdev->ready_page);
 	kfree(bdev);
 	g_bdev = NULL;
 
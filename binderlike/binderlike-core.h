@@ -1,15 +1,84 @@
 #ifndef __BINDERLIKE_CORE_H__
 #define __BINDERLIKE_CORE_H__
 
+#ifdef __KERNEL__
 #include <linux/io.h>
+#else
+#include <sys/ioctl.h>
+#endif
 
 #define BINDERLIKE_INPUT_PARAM_MAX 6
 #define BINDERLIKE_CHAN_MAX 16
 
+/* notification coalescing bounds, in us */
+#define BINDERLIKE_COALESCE_US_DEFAULT 100
+#define BINDERLIKE_COALESCE_US_MAX     100000
+
+/* dma-bufs a chan holds for receivers that did not claim them yet */
+#define BINDERLIKE_DMABUF_MAX 64
+
+/* producers per chan with their own admission, see MOA_BINDERIOC_SET_QOS */
+#define BINDERLIKE_PRODUCER_MAX 16
+
+/* records a chan's capture ring may hold */
+#define BINDERLIKE_CAPTURE_MAX 4096
+
+/* payload arena, a payload takes at most one bitmap word of blocks */
+#define BINDERLIKE_ARENA_BLK_SIZE 4096
+#define BINDERLIKE_ARENA_BLK_RUN  32
+#define BINDERLIKE_ARENA_MAX      (4 * 1024 * 1024)
+
+/* msg state, written by the producer once content is complete */
+#define MOA_BINDERLIKE_MSG_FREE  0
+#define MOA_BINDERLIKE_MSG_READY 1
+/* taken by a conflating producer or its consumer, see moa_binderlike_queue */
+#define MOA_BINDERLIKE_MSG_BUSY  2
+
+/* msg type */
+#define MOA_BINDERLIKE_MSG_TYPE_DATA   0
+/* handle names a dma-buf held by the chan, see MOA_BINDERIOC_RECV_DMABUF */
+#define MOA_BINDERLIKE_MSG_TYPE_DMABUF 1
+/* arena_off/arena_len name a payload in the chan's arena */
+#define MOA_BINDERLIKE_MSG_TYPE_ARENA  2
+/* cq completion of an sq msg dropped past its deadline, key and content kept */
+#define MOA_BINDERLIKE_MSG_TYPE_EXPIRED 3
+
+/* msg flags */
+#define MOA_BINDERLIKE_MSG_F_NOTIFY_EXPIRED (1 << 0)
+
 struct moa_binderlike_msg {
+	volatile unsigned int state;
+	unsigned int len;
+	unsigned int type;
+	int handle;
+	unsigned int arena_off;
+	unsigned int arena_len;
+	/* conflation key, 0 never conflates */
+	unsigned int key;
+	unsigned int flags;
+	/* CLOCK_MONOTONIC ns after which the msg is dropped, 0 for never */
+	unsigned long long deadline_ns;
+	/* qos producer id of the file that posted it, 0 if unaccounted */
+	unsigned int producer;
+	/* CLOCK_MONOTONIC ns of the enqueue, only set in capture records */
+	unsigned long long ts_ns;
 	char content[256];
 };
 
+/* MOA_BINDERIOC_RECV_DMABUF flags */
+#define MOA_BINDERLIKE_DMABUF_DROP (1 << 0)
+
+struct moa_binderlike_dmabuf_msg {
+	/* SEND: dma-buf fd to pass, RECV: fd installed for the receiver */
+	int                                       fd;
+	/* RECV: handle of the dequeued entry */
+	int                                       handle;
+	unsigned int                              flags;
+	/* SEND: inline payload of the entry */
+	unsigned int                              len;
+	char                                      content[256];
+};
+
 struct moa_binderlike_queue_cap {
 	int sq_offset;
 	int cq_offset;
@@ -29,17 +98,219 @@ struct moa_binderlike_chan_info {
 	unsigned int                              mmap_sz;
 	unsigned int                              cq_offset;
 	unsigned int                              usr_cnt;
+	/* wake sq consumers after coalesce_cnt msgs or coalesce_us */
+	unsigned int                              coalesce_cnt;
+	unsigned int                              coalesce_us;
+	/* payload arena bytes, and where its header sits in the mmap */
+	unsigned int                              arena_sz;
+	unsigned int                              arena_offset;
+	/* MOA_BINDERLIKE_CHAN_* mode flags */
+	unsigned int                              flags;
+	/* capture ring records, and where that queue sits in the mmap */
+	unsigned int                              capture_cnt;
+	unsigned int                              capture_offset;
+};
+
+/* sq keeps only the newest pending msg per key */
+#define MOA_BINDERLIKE_CHAN_CONFLATE (1 << 0)
+/* only mapped producers post to the sq, its consumers may use the futex */
+#define MOA_BINDERLIKE_CHAN_USER_PRODUCERS (1 << 1)
+
+struct moa_binderlike_coalesce {
+	unsigned int                              cnt;
+	unsigned int                              us;
+};
+
+/*
+ * Device wide readiness page, mmap any binderlike node at
+ * MOA_BINDERLIKE_READY_MMAP_OFF. Bit n of bits is set by every producer
+ * publishing to the sq of chan n, and by the kernel when it sees chan n
+ * non-empty. The consumer clears it once it drained the chan, before its
+ * final pending check so a racing enqueue is not lost; the driver clears
+ * it when chan n goes away.
+ */
+#define MOA_BINDERLIKE_READY_MMAP_OFF 0x40000000
+
+struct moa_binderlike_ready {
+	volatile unsigned int                     bits;
+};
+
+/*
+ * Admission of msgs a file enqueues through the driver (write and
+ * MOA_BINDERIOC_SEND_DMABUF): a token bucket of rate msgs/s holding up to
+ * burst msgs, and reserved sq slots other producers cannot take. A
+ * throttled blocking file sleeps for its next token, a nonblocking one
+ * gets -EAGAIN; a msg that would eat into other producers' reservations
+ * fails with -EBUSY.
+ * Only syscall producers are admitted, msgs put straight into the mapped
+ * ring are not. mmap of the ring fails with -EPERM on a file with qos set,
+ * and MOA_BINDERIOC_SET_QOS fails with -EPERM on a file that mapped it.
+ */
+struct moa_binderlike_qos {
+	/* msgs per second, 0 for no limit */
+	unsigned int                              rate;
+	unsigned int                              burst;
+	unsigned int                              reserved;
+	/* out: id tagged into msg->producer */
+	unsigned int                              producer;
+	/* out: counters of the file */
+	unsigned long long                        admitted;
+	unsigned long long                        throttled;
+	unsigned long long                        delayed;
+	unsigned long long                        rejected;
+};
+
+struct moa_binderlike_wait_any {
+	/* chans to wait on, bit n for chan n */
+	unsigned int                              mask;
+	/* < 0 waits forever, 0 only checks */
+	int                                       timeout_ms;
+	/* out: the chans of mask that are ready */
+	unsigned int                              ready;
 };
 
-/* this struct should export to userspace */
+/*
+ * this struct should export to userspace
+ *
+ * Slot protocol, shared by the kernel and the userspace library:
+ * - a producer claims slot tail with a cmpxchg of tail to tail + 1, the
+ *   queue is full when tail + 1 equals head
+ * - it fills the slot, then sets the slot state to READY with release
+ *   semantics, so producers never wait on each other
+ * - the consumer reads msgs[head] only once its state is READY, sets it
+ *   back to FREE and moves head on with release semantics
+ * - a consumer about to sleep sets its MOA_BINDERLIKE_WAKE_* bit in
+ *   need_wakeup, then re-checks the queue; a producer only issues a wakeup
+ *   for the bits it finds set: FUTEX_WAKE on futex after bumping it, or
+ *   MOA_BINDERIOC_WAKE for consumers sleeping in read/poll
+ * - the kernel cannot FUTEX_WAKE, so every sq is flagged with
+ *   MOA_BINDERLIKE_PRODUCER_KERNEL at creation and its consumers sleep in
+ *   poll; only chans created with MOA_BINDERLIKE_CHAN_USER_PRODUCERS go
+ *   without it, the kernel never posts to their sq
+ * - with coalesce_cnt > 1 a producer finding a sleeper only counts the msg
+ *   in unnotified, it wakes once the count reaches coalesce_cnt; the first
+ *   counted msg arms a coalesce_us timer in the driver (from userspace with
+ *   MOA_BINDERIOC_WAKE(MOA_BINDERLIKE_WAKE_DEFER)) bounding the delay.
+ *   The timer lives in the kernel, so consumers of such queues sleep in
+ *   poll as well
+ * - on MOA_BINDERLIKE_QUEUE_CONFLATE queues a producer posting a keyed
+ *   DATA msg first looks for a pending entry of the same key between head
+ *   and tail, takes it with a cmpxchg of its state from READY to BUSY,
+ *   rewrites it and sets it READY again. The consumer takes every entry
+ *   the same way before reading it, so an entry is rewritten or consumed,
+ *   never both; a producer losing the race posts a new entry
+ * - a consumer drops the run of entries at head whose deadline_ns has
+ *   passed with a single head update, counts them in expired and, for
+ *   msgs flagged MOA_BINDERLIKE_MSG_F_NOTIFY_EXPIRED, posts an EXPIRED
+ *   completion to the cq when it has room
+ * - while MOA_BINDERLIKE_QUEUE_CAPTURE is set, a producer publishing an
+ *   entry also copies it, stamped with ts_ns, into the capture ring at
+ *   capture_off bytes from the queue. The capture ring is a queue of
+ *   capture_cnt entries with the same slot protocol, drained by userspace;
+ *   a record that finds it full is counted in its dropped and lost
+ */
 struct moa_binderlike_queue {
 	volatile int head;
 	volatile int tail;
+	volatile int need_wakeup;
+	volatile int futex;
+	volatile int producers;
+	volatile int coalesce_cnt;
+	volatile int coalesce_us;
+	volatile int unnotified;
+	volatile int flags;
+	/* msgs dropped at dequeue past their deadline */
+	volatile int expired;
+	/* capture ring of this queue, see above */
+	volatile int capture_off;
+	volatile int capture_cnt;
+	/* records a full capture ring lost */
+	volatile int dropped;
 	struct moa_binderlike_msg msgs[];
 };
 
+/* queue flags */
+#define MOA_BINDERLIKE_QUEUE_CONFLATE (1 << 0)
+#define MOA_BINDERLIKE_QUEUE_CAPTURE  (1 << 1)
+
+/* need_wakeup bits */
+#define MOA_BINDERLIKE_WAKE_KERNEL (1 << 0)
+#define MOA_BINDERLIKE_WAKE_FUTEX  (1 << 1)
+
+/* producers bits */
+#define MOA_BINDERLIKE_PRODUCER_KERNEL (1 << 0)
+
+/* MOA_BINDERIOC_WAKE modes */
+#define MOA_BINDERLIKE_WAKE_NOW   0
+#define MOA_BINDERLIKE_WAKE_DEFER 1
+
+
+/*
+ * Payload arena, mapped after the cq. Blocks of blk_size start at
+ * data_offset from the arena header; a set bit in bitmap marks an
+ * allocated block. A producer claims a run of free bits inside one bitmap
+ * word with cmpxchg, writes the payload and posts an ARENA entry holding
+ * the run's byte offset from the data start; the consumer clears the bits
+ * once it is done with the payload. Bits past blk_cnt are set at creation.
+ */
+struct moa_binderlike_arena {
+	unsigned int blk_size;
+	unsigned int blk_cnt;
+	unsigned int data_offset;
+	unsigned int reserved;
+	volatile unsigned int bitmap[];
+};
 
 #define MOA_BINDERIOC_CREATE_CHAN _IOWR('B', 0, struct moa_binderlike_chan_info)
+/* takes a pointer to a MOA_BINDERLIKE_WAKE_* mode */
+#define MOA_BINDERIOC_WAKE        _IOW('B', 1, int)
+#define MOA_BINDERIOC_SET_COALESCE _IOW('B', 2, struct moa_binderlike_coalesce)
+#define MOA_BINDERIOC_SEND_DMABUF _IOW('B', 3, struct moa_binderlike_dmabuf_msg)
+#define MOA_BINDERIOC_RECV_DMABUF _IOWR('B', 4, struct moa_binderlike_dmabuf_msg)
+#define MOA_BINDERIOC_GET_INFO    _IOR('B', 5, struct moa_binderlike_chan_info)
+#define MOA_BINDERIOC_WAIT_ANY    _IOWR('B', 6, struct moa_binderlike_wait_any)
+#define MOA_BINDERIOC_SET_QOS     _IOWR('B', 7, struct moa_binderlike_qos)
+#define MOA_BINDERIOC_GET_QOS     _IOR('B', 8, struct moa_binderlike_qos)
+/* arg 1 starts capturing the sq of the chan, 0 stops */
+#define MOA_BINDERIOC_SET_CAPTURE _IO('B', 9)
+
+/*
+ * minor 0 is the control node chans are created on, chan n is also
+ * reachable as its own node at minor n + 1
+ */
+#define BINDERLIKE_CTRL_NODE   "moa_binderlike"
+#define BINDERLIKE_CHAN_NODE   "moa_binderlike_chan%d"
+
+#ifdef __KERNEL__
+/* in-kernel client api, for drivers posting to a chan without userspace */
+struct moa_binderlike_chan;
+struct dma_buf;
 
+typedef void (*moa_binderlike_consume_fn)(struct moa_binderlike_chan *chan,
+					  const struct moa_binderlike_msg *msg,
+					  void *priv);
+
+struct moa_binderlike_chan *moa_binderlike_chan_get(int chan_id);
+void moa_binderlike_chan_put(struct moa_binderlike_chan *chan);
+
+struct moa_binderlike_msg *
+moa_binderlike_chan_reserve(struct moa_binderlike_chan *chan);
+void moa_binderlike_chan_commit(struct moa_binderlike_chan *chan,
+				struct moa_binderlike_msg *msg);
+int moa_binderlike_chan_post(struct moa_binderlike_chan *chan,
+			     const void *data, size_t len);
+int moa_binderlike_chan_post_key(struct moa_binderlike_chan *chan,
+				 unsigned int key, const void *data, size_t len);
+int moa_binderlike_chan_post_dmabuf(struct moa_binderlike_chan *chan,
+				    struct dma_buf *dmabuf,
+				    const void *data, size_t len);
+struct dma_buf *moa_binderlike_chan_take_dmabuf(struct moa_binderlike_chan *chan,
+						int handle);
+
+int moa_binderlike_chan_register_consumer(struct moa_binderlike_chan *chan,
+					  moa_binderlike_consume_fn fn,
+					  void *priv);
+void moa_binderlike_chan_unregister_consumer(struct moa_binderlike_chan *chan);
 #endif
 
+#endif
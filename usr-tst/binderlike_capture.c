@@ -0,0 +1,114 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include "binderlike_capture.h"
+
+#define BINDERLIKE_CAP_BATCH 64
+
+int binderlike_capture_start(struct moa_binderlike_chan *chan, FILE *out)
+{
+	struct binderlike_cap_hdr hdr;
+
+	if (!chan || !chan->cap || !out)
+		return -EINVAL;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = BINDERLIKE_CAP_MAGIC;
+	hdr.version = BINDERLIKE_CAP_VERSION;
+	hdr.chan_id = chan->info.id;
+	if (fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+		return -EIO;
+
+	if (ioctl(chan->fd, MOA_BINDERIOC_SET_CAPTURE, 1) < 0)
+		return -errno;
+	return 0;
+}
+
+int binderlike_capture_stop(struct moa_binderlike_chan *chan)
+{
+	if (!chan || !chan->cap)
+		return -EINVAL;
+
+	if (ioctl(chan->fd, MOA_BINDERIOC_SET_CAPTURE, 0) < 0)
+		return -errno;
+	return 0;
+}
+
+unsigned int binderlike_capture_dropped(struct moa_binderlike_chan *chan)
+{
+	if (!chan || !chan->cap)
+		return 0;
+	return __atomic_load_n(&chan->cap->dropped, __ATOMIC_RELAXED);
+}
+
+/* write out what the capture ring holds, returns the records written */
+int binderlike_capture_drain(struct moa_binderlike_chan *chan, FILE *out)
+{
+	struct binderlike_cap_rec rec;
+	struct binderlike_span span;
+	struct moa_binderlike_msg *msg;
+	int n, i, total = 0;
+
+	if (!chan || !chan->cap || !out)
+		return -EINVAL;
+
+	while ((n = dq_span(chan->cap, &span, BINDERLIKE_CAP_BATCH,
+			    chan->info.capture_cnt)) > 0)
+	{
+		for (i = 0; i < n; i++)
+		{
+			msg = binderlike_span_msg(&span, i);
+
+			memset(&rec, 0, sizeof(rec));
+			rec.ts_ns = msg->ts_ns;
+			rec.deadline_ns = msg->deadline_ns;
+			rec.key = msg->key;
+			rec.flags = msg->flags;
+			rec.producer = msg->producer;
+			rec.type = msg->type;
+			rec.len = msg->len < sizeof(msg->content) ?
+				  msg->len : sizeof(msg->content);
+
+			if (fwrite(&rec, sizeof(rec), 1, out) != 1 ||
+			    fwrite(msg->content, 1, rec.len, out) != rec.len)
+			{
+				dq_span_release(&span);
+				return -EIO;
+			}
+		}
+
+		dq_span_release(&span);
+		total += n;
+	}
+
+	return total;
+}
+
+int binderlike_capture_open(FILE *in, struct binderlike_cap_hdr *hdr)
+{
+	if (!in || !hdr)
+		return -EINVAL;
+
+	if (fread(hdr, sizeof(*hdr), 1, in) != 1)
+		return -EIO;
+
+	if (hdr->magic != BINDERLIKE_CAP_MAGIC ||
+	    hdr->version != BINDERLIKE_CAP_VERSION)
+		return -EPROTO;
+	return 0;
+}
+
+/* next record of a capture log, 1 on success and 0 at its end */
+int binderlike_capture_read(FILE *in, struct binderlike_cap_rec *rec,
+			    char *content, size_t sz)
+{
+	if (fread(rec, sizeof(*rec), 1, in) != 1)
+		return feof(in) ? 0 : -EIO;
+
+	if (rec->len > sz)
+		return -ENOSPC;
+
+	if (fread(content, 1, rec->len, in) != rec->len)
+		return -EIO;
+	return 1;
+}
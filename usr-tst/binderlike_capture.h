@@ -0,0 +1,39 @@
+#ifndef __BINDERLIKE_CAPTURE_H__
+#define __BINDERLIKE_CAPTURE_H__
+#include <stdio.h>
+#include "binderlike_chan.h"
+
+/*
+ * Capture log: one binderlike_cap_hdr, then one binderlike_cap_rec per
+ * captured sq entry followed by its len bytes of content.
+ */
+#define BINDERLIKE_CAP_MAGIC   0x50414342
+#define BINDERLIKE_CAP_VERSION 1
+
+struct binderlike_cap_hdr {
+	unsigned int                          magic;
+	unsigned int                          version;
+	int                                   chan_id;
+	unsigned int                          reserved;
+};
+
+struct binderlike_cap_rec {
+	/* enqueue time, CLOCK_MONOTONIC ns */
+	unsigned long long                    ts_ns;
+	unsigned long long                    deadline_ns;
+	unsigned int                          key;
+	unsigned int                          flags;
+	unsigned int                          producer;
+	unsigned short                        type;
+	unsigned short                        len;
+};
+
+int binderlike_capture_start(struct moa_binderlike_chan *chan, FILE *out);
+int binderlike_capture_drain(struct moa_binderlike_chan *chan, FILE *out);
+int binderlike_capture_stop(struct moa_binderlike_chan *chan);
+unsigned int binderlike_capture_dropped(struct moa_binderlike_chan *chan);
+
+int binderlike_capture_open(FILE *in, struct binderlike_cap_hdr *hdr);
+int binderlike_capture_read(FILE *in, struct binderlike_cap_rec *rec,
+			    char *content, size_t sz);
+#endif
@@ -8,52 +8,54 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "binderlike_chan.h"
 
 
-#define DEV_NAME "/dev/moa_binderlike"
-#define MOA_BINDERIOC_GET_QUEUE _IOR('B', 0, struct moa_binderlike_queue_cap)
-
-int Msg_Dequeue(struct moa_binderlike_chan *chan, char *buf, size_t sz);
+#define DEV_NAME      "/dev/" BINDERLIKE_CTRL_NODE
+#define CHAN_DEV_NAME "/dev/" BINDERLIKE_CHAN_NODE
 
 void binderlike_chan_release(struct moa_binderlike_chan *chan)
 {
-	int ret = 0;
-	if (chan)
-	{
-		ret = 0;
-	}
+	if (!chan)
+		return;
 
-	if (!ret && chan->fd > 0)
+	if (chan->sq)
 	{
-		if (chan->cap.memblk_size > 0 &&
-			chan->cap.cq_offset > 0)
-		{
-			ret = 0;
-		}
-		else
-		{
-			ret = -ENODEV;
-			close(chan->fd);
-		}
+		munmap(chan->sq, chan->info.mmap_sz);
 	}
 
-	if (!ret)
-	{
-		munmap(chan->sq, chan->cap.cq_offset);
-		munmap(chan->cq, chan->cap.memblk_size - chan->cap.cq_offset);
-	}
+	binderlike_ready_unmap(chan->ready);
 
-	if (!ret)
+	if (chan->fd > 0)
 	{
 		close(chan->fd);
-		free(chan);
 	}
 
+	free(chan);
 	printf("binderlike release\n");
 }
 
-struct moa_binderlike_chan *binderlike_create_instance(void)
+static inline void
+dump_binderlike_chan_info(const struct moa_binderlike_chan_info *info)
+{
+        printf("info [id %d, cache_cnt(%u), mmap_sz(%u), cq_offset(%u), "
+               "arena(%u@%u)]\n", info->id, info->cache_cnt, info->mmap_sz,
+               info->cq_offset, info->arena_sz, info->arena_offset);
+        return;
+}
+
+/*
+ * create a chan on the control node, or attach to an existing one through
+ * its own node when create is 0
+ */
+static struct moa_binderlike_chan *
+binderlike_instance(const char *node, int create,
+		    const struct moa_binderlike_chan_info *req)
 {
 	int ret = 0;
 	struct moa_binderlike_chan *chan;
@@ -63,43 +65,60 @@ struct moa_binderlike_chan *binderlike_create_instance(void)
 	{
 		int fd = -1;
 		memset((void *)chan, 0, sizeof(*chan));
-		fd = open(DEV_NAME, O_RDWR | O_NONBLOCK, S_IRUSR | S_IWUSR);
+		fd = open(node, O_RDWR | O_NONBLOCK, S_IRUSR | S_IWUSR);
 		ret = fd > 0 ? 0 : -ENOTTY;
 		chan->fd = fd;
 	}
+	else
+	{
+		ret = -ENOMEM;
+	}
 
 	if (!ret)
 	{
-		struct moa_binderlike_queue_cap cap;
-		ret = ioctl(chan->fd, MOA_BINDERIOC_GET_QUEUE, &cap);
+		struct moa_binderlike_chan_info *info;
+
+		info = &chan->info;
+
+		if (req)
+			memcpy(info, req, sizeof(*info));
+		info->id = 0;
+		ret = ioctl(chan->fd, create ? MOA_BINDERIOC_CREATE_CHAN :
+					       MOA_BINDERIOC_GET_INFO, info);
 		if (ret)
 		{
-			printf("get queue cap failed\n");
+			perror("get queue cap failed\n");
 		}
 		else
 		{
-			chan->cap = cap;
-                        printf("record cap %d %d %d\n", cap.sq_offset,
-                               cap.cq_offset, cap.memblk_size);
+			dump_binderlike_chan_info(info);
                 }
         }
 
 	if (!ret)
 	{
 		void *addr = NULL;
-                addr = mmap(NULL, chan->cap.memblk_size, PROT_READ | PROT_WRITE,
+                addr = mmap(NULL, chan->info.mmap_sz, PROT_READ | PROT_WRITE,
                             MAP_SHARED, chan->fd, 0);
-                if (addr) {
+                if (addr != MAP_FAILED) {
                         chan->sq = (struct moa_binderlike_queue *)addr;
                         printf("sq %p created, h %d, t %d, len %d\n", chan->sq,
                                chan->sq->head, chan->sq->tail,
-                               chan->sq->total_len);
+                               chan->info.cache_cnt);
 
                         chan->cq = (struct moa_binderlike_queue *)(addr +
-                                   chan->cap.cq_offset);
+                                   chan->info.cq_offset);
                         printf("cq %p created, h %d, t %d, len %d\n", chan->cq,
                                chan->cq->head, chan->cq->tail,
-                               chan->cq->total_len);
+                               chan->info.cache_cnt);
+
+                        if (chan->info.arena_sz)
+                                chan->arena = (struct moa_binderlike_arena *)
+                                              (addr + chan->info.arena_offset);
+
+                        if (chan->info.capture_cnt)
+                                chan->cap = (struct moa_binderlike_queue *)
+                                            (addr + chan->info.capture_offset);
                 } else {
                         perror("mmap submit queue failed\n");
 			ret = -ENOMEM;
@@ -110,42 +129,631 @@ struct moa_binderlike_chan *binderlike_create_instance(void)
 	if (!ret)
 	{
 		chan->dequeue = Msg_Dequeue;
-		chan->queue = NULL;
+		chan->queue = Msg_Queue;
+		chan->ready = binderlike_ready_map(chan->fd);
+		binderlike_chan_set_spin(chan, BINDERLIKE_SPIN_US);
 	}
 
-	if (ret < 0)
+	if (ret < 0 && chan)
 	{
 		binderlike_chan_release(chan);
+		chan = NULL;
 	}
 
 	return chan;
 }
 
-int dq_msg(struct moa_binderlike_queue *q, char *buf, size_t sz)
+struct moa_binderlike_chan *binderlike_create_instance(void)
+{
+	return binderlike_create_instance_arena(0);
+}
+
+struct moa_binderlike_chan *binderlike_create_instance_arena(unsigned int arena_sz)
+{
+	return binderlike_create_instance_ex(arena_sz, 0);
+}
+
+struct moa_binderlike_chan *binderlike_create_instance_ex(unsigned int arena_sz,
+							  unsigned int flags)
+{
+	struct moa_binderlike_chan_info req;
+
+	memset(&req, 0, sizeof(req));
+	req.arena_sz = arena_sz;
+	req.flags = flags;
+	return binderlike_create_instance_req(&req);
+}
+
+/* create a chan from the sizing and mode fields of req */
+struct moa_binderlike_chan *
+binderlike_create_instance_req(const struct moa_binderlike_chan_info *req)
+{
+	return binderlike_instance(DEV_NAME, 1, req);
+}
+
+/* map a chan created by another process, it stays up while it is open */
+struct moa_binderlike_chan *binderlike_open_instance(int id)
+{
+	char node[64];
+
+	if (id < 0 || id >= BINDERLIKE_CHAN_MAX)
+		return NULL;
+
+	snprintf(node, sizeof(node), CHAN_DEV_NAME, id);
+	return binderlike_instance(node, 0, NULL);
+}
+
+/*
+ * Collect up to max entries from head that producers have published. A
+ * claimed but unpublished slot ends the span, entries behind it are
+ * picked up by the next call.
+ */
+int dq_span(struct moa_binderlike_queue *q, struct binderlike_span *span,
+	    int max, unsigned int cache_cnt)
+{
+	int head = q->head;
+	int tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+	int idx = head, cnt = 0;
+	int conflate = __atomic_load_n(&q->flags, __ATOMIC_RELAXED) &
+		       MOA_BINDERLIKE_QUEUE_CONFLATE;
+
+	while (cnt < max && idx != tail)
+	{
+		if (conflate)
+		{
+			/* take it from producers that would rewrite it */
+			int ready = MOA_BINDERLIKE_MSG_READY;
+
+			if (!__atomic_compare_exchange_n(&q->msgs[idx].state,
+							 &ready,
+							 MOA_BINDERLIKE_MSG_BUSY,
+							 0, __ATOMIC_ACQUIRE,
+							 __ATOMIC_RELAXED))
+				break;
+		}
+		else if (__atomic_load_n(&q->msgs[idx].state,
+					 __ATOMIC_ACQUIRE) !=
+			 MOA_BINDERLIKE_MSG_READY)
+		{
+			break;
+		}
+
+		cnt++;
+		if (++idx == (int)cache_cnt)
+			idx = 0;
+	}
+
+	span->q = q;
+	span->cache_cnt = cache_cnt;
+	span->head = head;
+	span->cnt = cnt;
+
+	if (cnt)
+		__builtin_prefetch(&q->msgs[head], 0, 0);
+
+	return cnt ? cnt : -ENOTTY;
+}
+
+void dq_span_release(struct binderlike_span *span)
+{
+	struct moa_binderlike_queue *q = span->q;
+	int idx = span->head, i;
+
+	if (!span->cnt)
+		return;
+
+	for (i = 0; i < span->cnt; i++)
+	{
+		__atomic_store_n(&q->msgs[idx].state, MOA_BINDERLIKE_MSG_FREE,
+				 __ATOMIC_RELAXED);
+		if (++idx == (int)span->cache_cnt)
+			idx = 0;
+	}
+
+	/* hand the slots back before producers can see the new head */
+	__atomic_store_n(&q->head, idx, __ATOMIC_RELEASE);
+	span->cnt = 0;
+}
+
+static int dq_msg_copy(const struct moa_binderlike_msg *msg, char *buf,
+		       size_t sz)
+{
+	size_t n = msg->len;
+
+	if (!sz)
+		return 0;
+
+	/* content is not terminated, a full record fills the whole slot */
+	if (n > sizeof(msg->content))
+		n = sizeof(msg->content);
+	if (n > sz - 1)
+		n = sz - 1;
+	memcpy(buf, msg->content, n);
+	buf[n] = '\0';
+
+	if (n > 0 && buf[n - 1] == '\n')
+		buf[--n] = '\0';
+	return (int)n;
+}
+
+/*
+ * Bare queue, no chan to release what an entry carries: only for queues
+ * without DMABUF or ARENA entries, Msg_Dequeue() handles those.
+ */
+int dq_msg(struct moa_binderlike_queue *q, char *buf, size_t sz,
+           unsigned int cache_cnt)
 {
 	int ret = 0;
-	if (q->head == q->tail)
+	struct binderlike_span span;
+
+	ret = dq_span(q, &span, 1, cache_cnt);
+
+	if (ret > 0)
 	{
-		ret = -ENOTTY;
+		ret = dq_msg_copy(binderlike_span_msg(&span, 0), buf, sz);
+		dq_span_release(&span);
 	}
 
-	if (!ret)
+	return ret;
+}
+
+/* same slot protocol as moa_binderlike_chan_reserve() in the driver */
+static struct moa_binderlike_msg *
+qmsg_reserve(struct moa_binderlike_queue *q, unsigned int cache_cnt)
+{
+	int cur, next;
+
+	cur = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	do
 	{
-		sz = snprintf(buf, sz, "%s", q->msgs[q->head].content);
-		if (buf[sz - 1] == '\n')
-			buf[sz - 1] = '\0';
-		q->head = (q->head + 1) % q->total_len;
+		next = (cur + 1) % cache_cnt;
+		if (__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == next)
+		{
+			return NULL;
+		}
+	} while (!__atomic_compare_exchange_n(&q->tail, &cur, next, 0,
+					      __ATOMIC_ACQ_REL,
+					      __ATOMIC_RELAXED));
+
+	return &q->msgs[cur];
+}
+
+static int qmsg_fill(struct moa_binderlike_msg *msg, const char *buf,
+		     size_t sz)
+{
+	if (buf && sz)
+		memcpy(msg->content, buf, sz);
+	if (sz > 0 && msg->content[sz - 1] == '\n')
+		sz--;
+	msg->content[sz] = '\0';
+	msg->len = sz;
+	msg->type = MOA_BINDERLIKE_MSG_TYPE_DATA;
+	msg->handle = 0;
+	msg->arena_off = 0;
+	msg->arena_len = 0;
+	msg->key = 0;
+	msg->flags = 0;
+	msg->deadline_ns = 0;
+	msg->producer = 0;
+	return sz;
+}
+
+/* pending DATA entry of key taken BUSY for a rewrite, NULL if none */
+static struct moa_binderlike_msg *
+qmsg_conflate(struct moa_binderlike_queue *q, unsigned int key,
+	      unsigned int cache_cnt)
+{
+	struct moa_binderlike_msg *msg;
+	int idx = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	int tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+	int ready;
+
+	for (; idx != tail; idx = (idx + 1) % cache_cnt)
+	{
+		msg = &q->msgs[idx];
+		if (__atomic_load_n(&msg->key, __ATOMIC_RELAXED) != key ||
+		    __atomic_load_n(&msg->type, __ATOMIC_RELAXED) !=
+			    MOA_BINDERLIKE_MSG_TYPE_DATA)
+			continue;
+
+		ready = MOA_BINDERLIKE_MSG_READY;
+		if (!__atomic_compare_exchange_n(&msg->state, &ready,
+						 MOA_BINDERLIKE_MSG_BUSY, 0,
+						 __ATOMIC_ACQUIRE,
+						 __ATOMIC_RELAXED))
+			continue;
+
+		/* the slot may have been consumed and reused meanwhile */
+		if (msg->key == key && msg->type == MOA_BINDERLIKE_MSG_TYPE_DATA)
+			return msg;
+		__atomic_store_n(&msg->state, MOA_BINDERLIKE_MSG_READY,
+				 __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+/* copy an entry into the queue's capture ring, never waits for its reader */
+static void qmsg_capture(struct moa_binderlike_queue *q,
+			 const struct moa_binderlike_msg *msg)
+{
+	struct moa_binderlike_queue *cap;
+	struct moa_binderlike_msg *rec;
+
+	cap = (struct moa_binderlike_queue *)((char *)q + q->capture_off);
+	rec = qmsg_reserve(cap, q->capture_cnt);
+	if (!rec)
+	{
+		__atomic_fetch_add(&cap->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	rec->len = msg->len;
+	rec->type = msg->type;
+	rec->handle = msg->handle;
+	rec->arena_off = msg->arena_off;
+	rec->arena_len = msg->arena_len;
+	rec->key = msg->key;
+	rec->flags = msg->flags;
+	rec->deadline_ns = msg->deadline_ns;
+	rec->producer = msg->producer;
+	rec->ts_ns = binderlike_now_ns();
+	memcpy(rec->content, msg->content, msg->len);
+	__atomic_store_n(&rec->state, MOA_BINDERLIKE_MSG_READY,
+			 __ATOMIC_RELEASE);
+}
+
+static void qmsg_publish(struct moa_binderlike_queue *q,
+			 struct moa_binderlike_msg *msg)
+{
+	if ((__atomic_load_n(&q->flags, __ATOMIC_RELAXED) &
+	     MOA_BINDERLIKE_QUEUE_CAPTURE) && q->capture_cnt)
+		qmsg_capture(q, msg);
+
+	__atomic_store_n(&msg->state, MOA_BINDERLIKE_MSG_READY,
+			 __ATOMIC_RELEASE);
+}
+
+int qmsg(struct moa_binderlike_queue *q, const char *buf, size_t sz,
+	 unsigned int cache_cnt)
+{
+	struct moa_binderlike_msg *msg;
+
+	if (sz + 1 >= sizeof(msg->content))
+	{
+		return -ENOSPC;
 	}
 
+	msg = qmsg_reserve(q, cache_cnt);
+	if (!msg)
+	{
+		return -EBUSY;
+	}
+
+	sz = qmsg_fill(msg, buf, sz);
+
+	qmsg_publish(q, msg);
 	return sz;
 }
 
-int qmsg(struct moa_binderlike_queue *q, char *buf, size_t sz)
+#if defined(__arm__) || defined(__aarch64__)
+#define binderlike_cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#elif defined(__x86_64__) || defined(__i386__)
+#define binderlike_cpu_relax() __asm__ __volatile__("pause" ::: "memory")
+#else
+#define binderlike_cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+static inline unsigned long long binderlike_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* the clock msg deadlines are measured against */
+unsigned long long binderlike_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline long binderlike_futex(volatile int *uaddr, int op, int val,
+				    const struct timespec *timeout)
+{
+	return syscall(SYS_futex, uaddr, op, val, timeout, NULL, 0);
+}
+
+void binderlike_chan_set_spin(struct moa_binderlike_chan *chan,
+			      unsigned int spin_us)
+{
+	if (!chan)
+		return;
+
+	chan->spin_us = spin_us;
+	chan->spin_cur_us = spin_us;
+}
+
+/* wake whoever sleeps on q, only if a sleeper flagged itself */
+void binderlike_chan_kick(struct moa_binderlike_chan *chan,
+			  struct moa_binderlike_queue *q)
 {
-	// TODO: to be implememted
+	int flags;
+
+	/* wait-any users spin on the page, flag every sq publish */
+	if (q == chan->sq && chan->ready &&
+	    !(__atomic_load_n(&chan->ready->bits, __ATOMIC_RELAXED) &
+	      (1U << chan->info.id)))
+		__atomic_fetch_or(&chan->ready->bits, 1U << chan->info.id,
+				  __ATOMIC_RELEASE);
+
+	/* pairs with the barrier the consumer issues before sleeping */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&q->need_wakeup, __ATOMIC_RELAXED))
+		return;
+
+	if (q == chan->sq && binderlike_queue_coalesced(q))
+	{
+		int cnt = __atomic_load_n(&q->coalesce_cnt, __ATOMIC_RELAXED);
+		int pending = __atomic_fetch_add(&q->unnotified, 1,
+						 __ATOMIC_RELAXED);
+
+		if (pending + 1 < cnt)
+		{
+			/* the first held back msg arms the delay bound */
+			if (!pending)
+			{
+				int mode = MOA_BINDERLIKE_WAKE_DEFER;
+
+				ioctl(chan->fd, MOA_BINDERIOC_WAKE, &mode);
+			}
+			return;
+		}
+	}
+
+	flags = __atomic_exchange_n(&q->need_wakeup, 0, __ATOMIC_SEQ_CST);
+
+	if (flags & MOA_BINDERLIKE_WAKE_FUTEX)
+	{
+		__atomic_fetch_add(&q->futex, 1, __ATOMIC_SEQ_CST);
+		binderlike_futex(&q->futex, FUTEX_WAKE, INT_MAX, NULL);
+	}
+
+	if (flags & MOA_BINDERLIKE_WAKE_KERNEL)
+	{
+		int mode = MOA_BINDERLIKE_WAKE_NOW;
+
+		ioctl(chan->fd, MOA_BINDERIOC_WAKE, &mode);
+	}
+}
+
+int binderlike_chan_set_coalesce(struct moa_binderlike_chan *chan,
+				 unsigned int cnt, unsigned int us)
+{
+	struct moa_binderlike_coalesce co = { .cnt = cnt, .us = us };
+
+	if (!chan)
+		return -EINVAL;
+
+	if (ioctl(chan->fd, MOA_BINDERIOC_SET_COALESCE, &co) < 0)
+		return -errno;
+
+	chan->info.coalesce_cnt = chan->sq->coalesce_cnt;
+	chan->info.coalesce_us = chan->sq->coalesce_us;
 	return 0;
 }
 
+/*
+ * Wait until the sq has a ready entry. Spin for up to spin_cur_us first,
+ * then sleep: on the futex when only userspace produces into the sq and
+ * wakeups are not coalesced, in poll otherwise since the kernel cannot
+ * FUTEX_WAKE. The spin budget
+ * shrinks while spinning keeps failing and grows back to spin_us when
+ * messages arrive shortly after the consumer went to sleep.
+ */
+int binderlike_chan_wait(struct moa_binderlike_chan *chan, int timeout_ms)
+{
+	struct moa_binderlike_queue *q;
+	unsigned long long start, slept;
+	int ret = 0;
+
+	if (!chan || !chan->sq)
+		return -EINVAL;
+
+	q = chan->sq;
+	start = binderlike_now_us();
+	while (binderlike_now_us() - start < chan->spin_cur_us)
+	{
+		if (binderlike_queue_pending(q))
+			return 0;
+		binderlike_cpu_relax();
+	}
+
+	if (chan->spin_cur_us / 2 >= BINDERLIKE_SPIN_MIN_US)
+		chan->spin_cur_us /= 2;
+
+	start = binderlike_now_us();
+	if ((__atomic_load_n(&q->producers, __ATOMIC_RELAXED) &
+	     MOA_BINDERLIKE_PRODUCER_KERNEL) ||
+	    binderlike_queue_coalesced(q))
+	{
+		struct pollfd pfd = { .fd = chan->fd, .events = POLLIN };
+
+		/* the driver flags the kernel sleeper bit itself in poll */
+		ret = poll(&pfd, 1, timeout_ms);
+		ret = ret < 0 ? -errno : 0;
+	}
+	else
+	{
+		struct timespec ts, *pts = NULL;
+		int seen = __atomic_load_n(&q->futex, __ATOMIC_ACQUIRE);
+
+		__atomic_fetch_or(&q->need_wakeup, MOA_BINDERLIKE_WAKE_FUTEX,
+				  __ATOMIC_SEQ_CST);
+		/* pairs with the barrier in binderlike_chan_kick() */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		if (binderlike_queue_pending(q))
+			return 0;
+
+		if (timeout_ms >= 0)
+		{
+			ts.tv_sec = timeout_ms / 1000;
+			ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+			pts = &ts;
+		}
+
+		if (binderlike_futex(&q->futex, FUTEX_WAIT, seen, pts) < 0 &&
+		    errno != EAGAIN && errno != EINTR)
+		{
+			ret = -errno;
+		}
+	}
+
+	slept = binderlike_now_us() - start;
+	if (slept < chan->spin_us && binderlike_queue_pending(q))
+	{
+		chan->spin_cur_us *= 2;
+		if (chan->spin_cur_us > chan->spin_us)
+			chan->spin_cur_us = chan->spin_us;
+	}
+
+	if (!ret && !binderlike_queue_pending(q))
+		ret = -ETIMEDOUT;
+	return ret;
+}
+
+/* fd may be the control node or any chan node */
+struct moa_binderlike_ready *binderlike_ready_map(int fd)
+{
+	void *addr;
+
+	addr = mmap(NULL, sizeof(struct moa_binderlike_ready),
+		    PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+		    MOA_BINDERLIKE_READY_MMAP_OFF);
+	if (addr == MAP_FAILED)
+	{
+		perror("mmap ready page failed\n");
+		return NULL;
+	}
+	return addr;
+}
+
+void binderlike_ready_unmap(struct moa_binderlike_ready *ready)
+{
+	if (ready)
+		munmap((void *)ready, sizeof(*ready));
+}
+
+/*
+ * Sleep until any chan in mask has a pending sq entry. Returns the ready
+ * subset of mask, 0 on timeout or -errno.
+ */
+int binderlike_wait_any(int fd, unsigned int mask, int timeout_ms)
+{
+	struct moa_binderlike_wait_any wa;
+
+	memset(&wa, 0, sizeof(wa));
+	wa.mask = mask;
+	wa.timeout_ms = timeout_ms;
+	if (ioctl(fd, MOA_BINDERIOC_WAIT_ANY, &wa) < 0)
+		return -errno;
+	return wa.ready;
+}
+
+static void binderlike_notify_expired(struct moa_binderlike_chan *chan,
+				      const struct moa_binderlike_msg *msg)
+{
+	struct moa_binderlike_msg *done;
+
+	done = qmsg_reserve(chan->cq, chan->info.cache_cnt);
+	if (!done)
+	{
+		printf("chan %d cq is full, expired msg %u not reported\n",
+		       chan->info.id, msg->key);
+		return;
+	}
+
+	qmsg_fill(done, msg->content, msg->len < sizeof(done->content) ?
+				      msg->len : sizeof(done->content) - 1);
+	done->type = MOA_BINDERLIKE_MSG_TYPE_EXPIRED;
+	done->key = msg->key;
+	done->deadline_ns = msg->deadline_ns;
+	qmsg_publish(chan->cq, done);
+	binderlike_chan_kick(chan, chan->cq);
+}
+
+/*
+ * Same as moa_binderlike_queue_skip_expired() in the driver: drop the
+ * run of expired entries at head with one head update.
+ */
+int binderlike_skip_expired(struct moa_binderlike_chan *chan)
+{
+	struct moa_binderlike_queue *q = chan->sq;
+	struct moa_binderlike_msg *msg;
+	unsigned long long deadline, now = 0;
+	int cur = q->head, cnt = 0;
+	int conflate = q->flags & MOA_BINDERLIKE_QUEUE_CONFLATE;
+	int ready;
+
+	while (cur != __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE))
+	{
+		msg = &q->msgs[cur];
+		if (__atomic_load_n(&msg->state, __ATOMIC_ACQUIRE) !=
+		    MOA_BINDERLIKE_MSG_READY)
+			break;
+
+		deadline = msg->deadline_ns;
+		if (!deadline)
+			break;
+		if (!now)
+			now = binderlike_now_ns();
+		if (deadline > now)
+			break;
+
+		if (conflate)
+		{
+			ready = MOA_BINDERLIKE_MSG_READY;
+			if (!__atomic_compare_exchange_n(&msg->state, &ready,
+							 MOA_BINDERLIKE_MSG_BUSY,
+							 0, __ATOMIC_ACQUIRE,
+							 __ATOMIC_RELAXED))
+				break;
+
+			/* refreshed by a producer before the claim */
+			if (!msg->deadline_ns || msg->deadline_ns > now)
+			{
+				__atomic_store_n(&msg->state,
+						 MOA_BINDERLIKE_MSG_READY,
+						 __ATOMIC_RELEASE);
+				break;
+			}
+		}
+
+		if (msg->flags & MOA_BINDERLIKE_MSG_F_NOTIFY_EXPIRED)
+			binderlike_notify_expired(chan, msg);
+		binderlike_msg_drop_fd(chan, msg);
+		binderlike_msg_release_arena(chan, msg);
+
+		__atomic_store_n(&msg->state, MOA_BINDERLIKE_MSG_FREE,
+				 __ATOMIC_RELAXED);
+		if (++cur == (int)chan->info.cache_cnt)
+			cur = 0;
+		cnt++;
+	}
+
+	if (cnt)
+	{
+		__atomic_store_n(&q->head, cur, __ATOMIC_RELEASE);
+		__atomic_store_n(&q->expired, q->expired + cnt,
+				 __ATOMIC_RELAXED);
+	}
+	return cnt;
+}
+
 int Msg_Dequeue(struct moa_binderlike_chan *chan, char *buf, size_t sz)
 {
 	int ret = 0;
@@ -158,11 +766,359 @@ int Msg_Dequeue(struct moa_binderlike_chan *chan, char *buf, size_t sz)
 
 	if (!ret)
 	{
-		size_t sz;
-		sz = dq_msg(chan->sq, buf, sz);
-		ret = sz;
+		struct binderlike_span span;
+		struct moa_binderlike_msg *msg;
+
+		binderlike_skip_expired(chan);
+		ret = dq_span(chan->sq, &span, 1, chan->info.cache_cnt);
+		if (ret > 0)
+		{
+			msg = binderlike_span_msg(&span, 0);
+			ret = dq_msg_copy(msg, buf, sz);
+			/* the caller only gets the text, drop what it carried */
+			binderlike_msg_drop_fd(chan, msg);
+			binderlike_msg_release_arena(chan, msg);
+			dq_span_release(&span);
+		}
+	}
+	return ret;
+}
+
+int Msg_Dequeue_Span(struct moa_binderlike_chan *chan,
+		     struct binderlike_span *span, int max)
+{
+	int ret = 0;
+	if (!chan ||
+	    !span ||
+	    !chan->sq ||
+	    max <= 0)
+	{
+		ret = -EINVAL;
+	}
+
+	if (!ret)
+	{
+		binderlike_skip_expired(chan);
+		ret = dq_span(chan->sq, span, max, chan->info.cache_cnt);
+	}
+	return ret;
+}
+
+/* the driver posts the entry, the caller keeps its own fd */
+int Msg_Queue_Dmabuf(struct moa_binderlike_chan *chan, int fd,
+		     const char *buf, size_t sz)
+{
+	struct moa_binderlike_dmabuf_msg dmsg;
+	int ret;
+
+	if (!chan || fd < 0 || sz > sizeof(dmsg.content))
+		return -EINVAL;
+
+	memset(&dmsg, 0, sizeof(dmsg));
+	dmsg.fd = fd;
+	dmsg.len = sz;
+	if (buf && sz)
+		memcpy(dmsg.content, buf, sz);
+
+	ret = ioctl(chan->fd, MOA_BINDERIOC_SEND_DMABUF, &dmsg);
+	return ret < 0 ? -errno : ret;
+}
+
+/*
+ * Install the dma-buf a dequeued entry carries into this process. Must be
+ * called before the entry is released; the returned fd is the caller's.
+ */
+int binderlike_msg_take_fd(struct moa_binderlike_chan *chan,
+			   const struct moa_binderlike_msg *msg)
+{
+	struct moa_binderlike_dmabuf_msg dmsg;
+
+	if (!chan || !msg || msg->type != MOA_BINDERLIKE_MSG_TYPE_DMABUF)
+		return -EINVAL;
+
+	memset(&dmsg, 0, sizeof(dmsg));
+	dmsg.handle = msg->handle;
+	if (ioctl(chan->fd, MOA_BINDERIOC_RECV_DMABUF, &dmsg) < 0)
+		return -errno;
+	return dmsg.fd;
+}
+
+void binderlike_msg_drop_fd(struct moa_binderlike_chan *chan,
+			    const struct moa_binderlike_msg *msg)
+{
+	struct moa_binderlike_dmabuf_msg dmsg;
+
+	if (!chan || !msg || msg->type != MOA_BINDERLIKE_MSG_TYPE_DMABUF)
+		return;
+
+	memset(&dmsg, 0, sizeof(dmsg));
+	dmsg.handle = msg->handle;
+	dmsg.flags = MOA_BINDERLIKE_DMABUF_DROP;
+	ioctl(chan->fd, MOA_BINDERIOC_RECV_DMABUF, &dmsg);
+}
+
+static inline unsigned char *
+binderlike_arena_data(struct moa_binderlike_arena *arena)
+{
+	return (unsigned char *)arena + arena->data_offset;
+}
+
+/*
+ * Claim a run of free blocks within one bitmap word, the layout is
+ * described above struct moa_binderlike_arena.
+ */
+void *binderlike_arena_alloc(struct moa_binderlike_chan *chan, size_t sz)
+{
+	struct moa_binderlike_arena *arena;
+	unsigned int cnt, words, w, bit, run, word;
+
+	if (!chan || !chan->arena || !sz)
+		return NULL;
+
+	arena = chan->arena;
+	cnt = (sz + arena->blk_size - 1) / arena->blk_size;
+	if (cnt > BINDERLIKE_ARENA_BLK_RUN)
+		return NULL;
+
+	run = cnt == 32 ? ~0U : (1U << cnt) - 1;
+	words = (arena->blk_cnt + 31) / 32;
+	for (w = 0; w < words; w++)
+	{
+		word = __atomic_load_n(&arena->bitmap[w], __ATOMIC_RELAXED);
+		for (bit = 0; bit + cnt <= 32; )
+		{
+			if (word & (run << bit))
+			{
+				bit++;
+				continue;
+			}
+
+			if (__atomic_compare_exchange_n(&arena->bitmap[w],
+							&word,
+							word | (run << bit), 0,
+							__ATOMIC_ACQUIRE,
+							__ATOMIC_RELAXED))
+				return binderlike_arena_data(arena) +
+				       (w * 32 + bit) * arena->blk_size;
+			/* word was reloaded, retry the same position */
+		}
 	}
 
+	return NULL;
+}
+
+void binderlike_arena_free(struct moa_binderlike_chan *chan, void *ptr,
+			   size_t sz)
+{
+	struct moa_binderlike_arena *arena;
+	unsigned int blk, cnt, mask;
+
+	if (!chan || !chan->arena || !ptr || !sz)
+		return;
+
+	arena = chan->arena;
+	blk = ((unsigned char *)ptr - binderlike_arena_data(arena)) /
+	      arena->blk_size;
+	cnt = (sz + arena->blk_size - 1) / arena->blk_size;
+	if (cnt > BINDERLIKE_ARENA_BLK_RUN || blk % 32 + cnt > 32 ||
+	    blk + cnt > arena->blk_cnt)
+		return;
+
+	mask = (cnt == 32 ? ~0U : (1U << cnt) - 1) << (blk % 32);
+	__atomic_fetch_and(&arena->bitmap[blk / 32], ~mask, __ATOMIC_RELEASE);
+}
+
+/* payload of an ARENA entry, valid until binderlike_msg_release_arena() */
+void *binderlike_arena_ptr(struct moa_binderlike_chan *chan,
+			   const struct moa_binderlike_msg *msg)
+{
+	struct moa_binderlike_arena *arena;
+
+	if (!chan || !chan->arena || !msg ||
+	    msg->type != MOA_BINDERLIKE_MSG_TYPE_ARENA)
+		return NULL;
+
+	arena = chan->arena;
+	if (msg->arena_off + (unsigned long long)msg->arena_len >
+	    (unsigned long long)arena->blk_cnt * arena->blk_size)
+		return NULL;
+
+	return binderlike_arena_data(arena) + msg->arena_off;
+}
+
+void binderlike_msg_release_arena(struct moa_binderlike_chan *chan,
+				  const struct moa_binderlike_msg *msg)
+{
+	void *ptr = binderlike_arena_ptr(chan, msg);
+
+	if (ptr)
+		binderlike_arena_free(chan, ptr, msg->arena_len);
+}
+
+/*
+ * Post a payload from binderlike_arena_alloc() by offset, buf is an
+ * optional inline header. The receiver frees the blocks once done.
+ */
+int Msg_Queue_Arena(struct moa_binderlike_chan *chan, void *payload,
+		    size_t payload_len, const char *buf, size_t sz)
+{
+	struct moa_binderlike_msg *msg;
+
+	if (!chan || !chan->sq || !chan->arena || !payload || !payload_len ||
+	    sz + 1 >= sizeof(msg->content))
+	{
+		return -EINVAL;
+	}
+
+	msg = qmsg_reserve(chan->sq, chan->info.cache_cnt);
+	if (!msg)
+	{
+		return -EBUSY;
+	}
+
+	sz = qmsg_fill(msg, buf, sz);
+	msg->type = MOA_BINDERLIKE_MSG_TYPE_ARENA;
+	msg->arena_off = (unsigned char *)payload -
+			 binderlike_arena_data(chan->arena);
+	msg->arena_len = payload_len;
+
+	qmsg_publish(chan->sq, msg);
+	binderlike_chan_kick(chan, chan->sq);
+	return sz;
+}
+
+/*
+ * Post buf under key. On a conflating chan a pending msg of the same key
+ * is overwritten in place, so repeated updates never fill the sq.
+ */
+int Msg_Queue_Key(struct moa_binderlike_chan *chan, unsigned int key,
+		  const char *buf, size_t sz)
+{
+	struct moa_binderlike_msg *msg = NULL;
+	struct moa_binderlike_queue *q;
+
+	if (!chan || !buf || !chan->sq || sz + 1 >= sizeof(msg->content))
+	{
+		return -EINVAL;
+	}
+
+	q = chan->sq;
+	if (key && (q->flags & MOA_BINDERLIKE_QUEUE_CONFLATE))
+	{
+		msg = qmsg_conflate(q, key, chan->info.cache_cnt);
+	}
+
+	if (!msg)
+	{
+		msg = qmsg_reserve(q, chan->info.cache_cnt);
+		if (!msg)
+		{
+			return -EBUSY;
+		}
+	}
+
+	sz = qmsg_fill(msg, buf, sz);
+	msg->key = key;
+
+	qmsg_publish(q, msg);
+	binderlike_chan_kick(chan, q);
+	return sz;
+}
+
+/*
+ * Post buf to be dropped at dequeue once deadline_ns (see
+ * binderlike_now_ns()) has passed, flags take MOA_BINDERLIKE_MSG_F_*.
+ */
+int Msg_Queue_Deadline(struct moa_binderlike_chan *chan, const char *buf,
+		       size_t sz, unsigned long long deadline_ns,
+		       unsigned int flags)
+{
+	struct moa_binderlike_msg *msg;
+
+	if (!chan || !buf || !chan->sq || sz + 1 >= sizeof(msg->content))
+	{
+		return -EINVAL;
+	}
+
+	msg = qmsg_reserve(chan->sq, chan->info.cache_cnt);
+	if (!msg)
+	{
+		return -EBUSY;
+	}
+
+	sz = qmsg_fill(msg, buf, sz);
+	msg->flags = flags;
+	msg->deadline_ns = deadline_ns;
+
+	qmsg_publish(chan->sq, msg);
+	binderlike_chan_kick(chan, chan->sq);
+	return sz;
+}
+
+/* admission limits of this file's msgs, see struct moa_binderlike_qos */
+int binderlike_chan_set_qos(struct moa_binderlike_chan *chan,
+			    unsigned int rate, unsigned int burst,
+			    unsigned int reserved)
+{
+	struct moa_binderlike_qos qos;
+
+	if (!chan)
+		return -EINVAL;
+
+	memset(&qos, 0, sizeof(qos));
+	qos.rate = rate;
+	qos.burst = burst;
+	qos.reserved = reserved;
+	if (ioctl(chan->fd, MOA_BINDERIOC_SET_QOS, &qos) < 0)
+		return -errno;
+	return qos.producer;
+}
+
+int binderlike_chan_get_qos(struct moa_binderlike_chan *chan,
+			    struct moa_binderlike_qos *qos)
+{
+	if (!chan || !qos)
+		return -EINVAL;
+
+	if (ioctl(chan->fd, MOA_BINDERIOC_GET_QOS, qos) < 0)
+		return -errno;
+	return 0;
+}
+
+/*
+ * Post through the driver instead of the mapped ring, so the msg goes
+ * through this file's admission.
+ */
+int Msg_Post(struct moa_binderlike_chan *chan, const char *buf, size_t sz)
+{
+	ssize_t ret;
+
+	if (!chan || !buf)
+		return -EINVAL;
+
+	ret = write(chan->fd, buf, sz);
+	return ret < 0 ? -errno : (int)ret;
+}
+
+int Msg_Queue(struct moa_binderlike_chan *chan, char *buf, size_t sz)
+{
+	int ret = 0;
+	if (!chan ||
+	    !buf ||
+	    !chan->sq)
+	{
+		ret = -EINVAL;
+	}
+
+	if (!ret)
+	{
+		ret = qmsg(chan->sq, buf, sz, chan->info.cache_cnt);
+	}
+
+	if (ret >= 0)
+	{
+		binderlike_chan_kick(chan, chan->sq);
+	}
 	return ret;
 }
 
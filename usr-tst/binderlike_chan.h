@@ -1,14 +1,162 @@
+#ifndef __BINDERLIKE_CHAN_H__
+#define __BINDERLIKE_CHAN_H__
 #include <sys/types.h>
 #include "../binderlike/binderlike-core.h"
 
+struct moa_binderlike_chan;
+
 typedef int (*dqMsg)(struct moa_binderlike_chan *chan, char *buf, size_t len);
 typedef int (*qMsg)(struct moa_binderlike_chan *chan, char *buf, size_t len);
 
+/* default and floor of the adaptive spin before a consumer sleeps */
+#define BINDERLIKE_SPIN_US      50
+#define BINDERLIKE_SPIN_MIN_US  1
+
 struct moa_binderlike_chan {
 	int fd;
 	struct moa_binderlike_queue *sq;
 	struct moa_binderlike_queue *cq;
+	/* payload arena, NULL when the chan has none */
+	struct moa_binderlike_arena *arena;
+	/* capture ring of the sq, NULL when the chan has none */
+	struct moa_binderlike_queue *cap;
+	/* device readiness page, NULL when the driver has none */
+	struct moa_binderlike_ready *ready;
 	struct moa_binderlike_chan_info info;
 	dqMsg dequeue;
 	qMsg queue;
+
+	/* configured spin budget and its current adapted value */
+	unsigned int spin_us;
+	unsigned int spin_cur_us;
+};
+
+/* entries ahead of the one being handled that get prefetched */
+#define BINDERLIKE_SPAN_PREFETCH 2
+
+/*
+ * A run of ready sq entries handled in place. Slots stay owned by the
+ * consumer until dq_span_release() hands them all back with a single
+ * head update.
+ */
+struct binderlike_span {
+	struct moa_binderlike_queue *q;
+	unsigned int cache_cnt;
+	int head;
+	int cnt;
 };
+
+static inline struct moa_binderlike_msg *
+binderlike_span_msg(const struct binderlike_span *span, int i)
+{
+	int idx = span->head + i;
+	int ahead = idx + BINDERLIKE_SPAN_PREFETCH;
+
+	if (idx >= (int)span->cache_cnt)
+		idx -= span->cache_cnt;
+
+	if (i + BINDERLIKE_SPAN_PREFETCH < span->cnt)
+	{
+		if (ahead >= (int)span->cache_cnt)
+			ahead -= span->cache_cnt;
+		__builtin_prefetch(&span->q->msgs[ahead], 0, 0);
+	}
+
+	return &span->q->msgs[idx];
+}
+
+static inline int binderlike_queue_pending(struct moa_binderlike_queue *q)
+{
+	int head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+
+	if (head == __atomic_load_n(&q->tail, __ATOMIC_RELAXED))
+		return 0;
+	return __atomic_load_n(&q->msgs[head].state, __ATOMIC_ACQUIRE) ==
+	       MOA_BINDERLIKE_MSG_READY;
+}
+
+static inline int binderlike_queue_coalesced(struct moa_binderlike_queue *q)
+{
+	return __atomic_load_n(&q->coalesce_cnt, __ATOMIC_RELAXED) > 1;
+}
+
+/* drop chan id from the ready set, then recheck its sq before sleeping */
+static inline void binderlike_ready_clear(struct moa_binderlike_ready *ready,
+					  int id)
+{
+	__atomic_fetch_and(&ready->bits, ~(1U << id), __ATOMIC_SEQ_CST);
+}
+
+static inline unsigned int
+binderlike_ready_bits(const struct moa_binderlike_ready *ready)
+{
+	return __atomic_load_n(&ready->bits, __ATOMIC_ACQUIRE);
+}
+
+static inline unsigned int
+binderlike_chan_expired(const struct moa_binderlike_chan *chan)
+{
+	return __atomic_load_n(&chan->sq->expired, __ATOMIC_RELAXED);
+}
+
+unsigned long long binderlike_now_ns(void);
+
+struct moa_binderlike_chan *binderlike_create_instance(void);
+struct moa_binderlike_chan *binderlike_create_instance_arena(unsigned int arena_sz);
+struct moa_binderlike_chan *binderlike_create_instance_ex(unsigned int arena_sz,
+							  unsigned int flags);
+struct moa_binderlike_chan *
+binderlike_create_instance_req(const struct moa_binderlike_chan_info *req);
+struct moa_binderlike_chan *binderlike_open_instance(int id);
+void binderlike_chan_release(struct moa_binderlike_chan *chan);
+void binderlike_chan_set_spin(struct moa_binderlike_chan *chan,
+			      unsigned int spin_us);
+int binderlike_chan_set_coalesce(struct moa_binderlike_chan *chan,
+				 unsigned int cnt, unsigned int us);
+int binderlike_chan_wait(struct moa_binderlike_chan *chan, int timeout_ms);
+struct moa_binderlike_ready *binderlike_ready_map(int fd);
+void binderlike_ready_unmap(struct moa_binderlike_ready *ready);
+int binderlike_wait_any(int fd, unsigned int mask, int timeout_ms);
+void binderlike_chan_kick(struct moa_binderlike_chan *chan,
+			  struct moa_binderlike_queue *q);
+
+int dq_span(struct moa_binderlike_queue *q, struct binderlike_span *span,
+	    int max, unsigned int cache_cnt);
+void dq_span_release(struct binderlike_span *span);
+int dq_msg(struct moa_binderlike_queue *q, char *buf, size_t sz,
+	   unsigned int cache_cnt);
+int qmsg(struct moa_binderlike_queue *q, const char *buf, size_t sz,
+	 unsigned int cache_cnt);
+
+int Msg_Dequeue(struct moa_binderlike_chan *chan, char *buf, size_t sz);
+int Msg_Queue(struct moa_binderlike_chan *chan, char *buf, size_t sz);
+int Msg_Queue_Dmabuf(struct moa_binderlike_chan *chan, int fd,
+		     const char *buf, size_t sz);
+int binderlike_msg_take_fd(struct moa_binderlike_chan *chan,
+			   const struct moa_binderlike_msg *msg);
+void binderlike_msg_drop_fd(struct moa_binderlike_chan *chan,
+			    const struct moa_binderlike_msg *msg);
+void *binderlike_arena_alloc(struct moa_binderlike_chan *chan, size_t sz);
+void binderlike_arena_free(struct moa_binderlike_chan *chan, void *ptr,
+			   size_t sz);
+void *binderlike_arena_ptr(struct moa_binderlike_chan *chan,
+			   const struct moa_binderlike_msg *msg);
+void binderlike_msg_release_arena(struct moa_binderlike_chan *chan,
+				  const struct moa_binderlike_msg *msg);
+int binderlike_chan_set_qos(struct moa_binderlike_chan *chan,
+			    unsigned int rate, unsigned int burst,
+			    unsigned int reserved);
+int binderlike_chan_get_qos(struct moa_binderlike_chan *chan,
+			    struct moa_binderlike_qos *qos);
+int Msg_Post(struct moa_binderlike_chan *chan, const char *buf, size_t sz);
+int binderlike_skip_expired(struct moa_binderlike_chan *chan);
+int Msg_Queue_Deadline(struct moa_binderlike_chan *chan, const char *buf,
+		       size_t sz, unsigned long long deadline_ns,
+		       unsigned int flags);
+int Msg_Queue_Key(struct moa_binderlike_chan *chan, unsigned int key,
+		  const char *buf, size_t sz);
+int Msg_Queue_Arena(struct moa_binderlike_chan *chan, void *payload,
+		    size_t payload_len, const char *buf, size_t sz);
+int Msg_Dequeue_Span(struct moa_binderlike_chan *chan,
+		     struct binderlike_span *span, int max);
+#endif
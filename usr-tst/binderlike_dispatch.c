@@ -0,0 +1,283 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "binderlike_dispatch.h"
+
+/*
+ * Every chan is owned by one worker at a time, so the sq keeps a single
+ * consumer. Chan i is at home on worker (i % worker_cnt); a worker whose
+ * home chans are all empty steals any other pending chan that is not
+ * busy, so a hot chan never waits behind its home worker.
+ */
+
+static inline int dispatch_chan_claim(struct binderlike_dispatch_chan *dc)
+{
+	int idle = 0;
+	return __atomic_compare_exchange_n(&dc->busy, &idle, 1, 0,
+					   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void dispatch_chan_release(struct binderlike_dispatch_chan *dc)
+{
+	__atomic_store_n(&dc->busy, 0, __ATOMIC_RELEASE);
+}
+
+static inline int dispatch_chan_pending(struct binderlike_dispatch_chan *dc)
+{
+	struct moa_binderlike_queue *q = dc->chan->sq;
+	return __atomic_load_n(&q->head, __ATOMIC_RELAXED) !=
+	       __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+}
+
+static void dispatch_post_result(struct binderlike_dispatch_chan *dc,
+				 const char *buf, int len)
+{
+	struct moa_binderlike_chan *chan = dc->chan;
+
+	if (qmsg(chan->cq, buf, len, chan->info.cache_cnt) < 0)
+	{
+		printf("chan %d cq is full, result dropped\n", chan->info.id);
+		return;
+	}
+
+	binderlike_chan_kick(chan, chan->cq);
+}
+
+static int dispatch_msg_take_fd(struct binderlike_dispatch_chan *dc,
+				const struct moa_binderlike_msg *msg)
+{
+	int fd;
+
+	if (msg->type != MOA_BINDERLIKE_MSG_TYPE_DMABUF)
+		return -1;
+
+	fd = binderlike_msg_take_fd(dc->chan, msg);
+	if (fd < 0)
+		printf("chan %d take dma-buf %d failed, %d\n",
+		       dc->chan->info.id, msg->handle, fd);
+	return fd < 0 ? -1 : fd;
+}
+
+static void dispatch_chan_handle(struct binderlike_dispatch_chan *dc,
+				 const struct moa_binderlike_msg *msg, int fd)
+{
+	char result[sizeof(msg->content)];
+	binderlike_param_t param;
+
+	memset(&param, 0, sizeof(param));
+	param.chan_id = dc->chan->info.id;
+	param.msg = msg->content;
+	param.msg_len = msg->len;
+	param.payload = binderlike_arena_ptr(dc->chan, msg);
+	param.payload_len = param.payload ? msg->arena_len : 0;
+	param.fd = fd;
+	param.result = result;
+	param.result_sz = sizeof(result);
+
+	dc->fn(&param);
+
+	/* arena blocks outlive the slot, so copied entries stay zero-copy */
+	binderlike_msg_release_arena(dc->chan, msg);
+
+	if (param.result_len > 0)
+		dispatch_post_result(dc, result, param.result_len);
+}
+
+static int dispatch_chan_run(struct binderlike_dispatch_chan *dc)
+{
+	struct moa_binderlike_msg batch[BINDERLIKE_DISPATCH_BATCH];
+	int fds[BINDERLIKE_DISPATCH_BATCH];
+	struct binderlike_span span;
+	struct moa_binderlike_msg *msg;
+	int n, i;
+
+	if (!dispatch_chan_claim(dc))
+		return 0;
+
+	n = Msg_Dequeue_Span(dc->chan, &span, BINDERLIKE_DISPATCH_BATCH);
+	if (n <= 0)
+	{
+		dispatch_chan_release(dc);
+		return 0;
+	}
+
+	if (dc->ordered)
+	{
+		/* the chan stays claimed, so handle the entries in place */
+		for (i = 0; i < n; i++)
+		{
+			msg = binderlike_span_msg(&span, i);
+			dispatch_chan_handle(dc, msg,
+					     dispatch_msg_take_fd(dc, msg));
+		}
+		dq_span_release(&span);
+		dispatch_chan_release(dc);
+		return n;
+	}
+
+	/* unordered chans may be drained by another worker meanwhile */
+	for (i = 0; i < n; i++)
+	{
+		msg = binderlike_span_msg(&span, i);
+		memcpy(&batch[i], msg, sizeof(batch[i]));
+		fds[i] = dispatch_msg_take_fd(dc, msg);
+	}
+	dq_span_release(&span);
+	dispatch_chan_release(dc);
+
+	for (i = 0; i < n; i++)
+		dispatch_chan_handle(dc, &batch[i], fds[i]);
+
+	return n;
+}
+
+static void dispatch_worker_idle(struct binderlike_dispatch_worker *w)
+{
+	binderlike_dispatcher_t *d = w->d;
+	unsigned int mask = 0;
+	int i, fd = -1;
+
+	/* sleep on home chans only, stealing is retried on timeout */
+	for (i = w->id; i < d->chan_cnt; i += d->worker_cnt)
+	{
+		mask |= 1U << d->chans[i].chan->info.id;
+		fd = d->chans[i].chan->fd;
+	}
+
+	if (fd < 0)
+	{
+		poll(NULL, 0, BINDERLIKE_DISPATCH_IDLE_MS);
+		return;
+	}
+
+	binderlike_wait_any(fd, mask, BINDERLIKE_DISPATCH_IDLE_MS);
+}
+
+static void *dispatch_worker_loop(void *arg)
+{
+	struct binderlike_dispatch_worker *w = arg;
+	binderlike_dispatcher_t *d = w->d;
+	int i, n;
+
+	while (__atomic_load_n(&d->running, __ATOMIC_RELAXED))
+	{
+		n = 0;
+		for (i = w->id; i < d->chan_cnt; i += d->worker_cnt)
+			n += dispatch_chan_run(&d->chans[i]);
+
+		if (n)
+		{
+			w->handled += n;
+			continue;
+		}
+
+		for (i = 0; i < d->chan_cnt; i++)
+		{
+			if (i % d->worker_cnt == w->id ||
+			    !dispatch_chan_pending(&d->chans[i]))
+				continue;
+			n += dispatch_chan_run(&d->chans[i]);
+		}
+
+		if (n)
+		{
+			w->handled += n;
+			w->stolen += n;
+			continue;
+		}
+
+		dispatch_worker_idle(w);
+	}
+
+	return NULL;
+}
+
+binderlike_dispatcher_t *binderlike_dispatcher_create(int worker_cnt)
+{
+	binderlike_dispatcher_t *d;
+
+	if (worker_cnt <= 0 || worker_cnt > BINDERLIKE_DISPATCH_WORKER_MAX)
+		return NULL;
+
+	d = malloc(sizeof(*d));
+	if (d)
+	{
+		memset(d, 0, sizeof(*d));
+		d->worker_cnt = worker_cnt;
+	}
+	return d;
+}
+
+int binderlike_dispatcher_add_chan(binderlike_dispatcher_t *d,
+				   struct moa_binderlike_chan *chan,
+				   binderlike_fn fn, int ordered)
+{
+	struct binderlike_dispatch_chan *dc;
+
+	if (!d || !chan || !fn)
+		return -EINVAL;
+
+	/* chans are only added before the workers run */
+	if (d->running)
+		return -EBUSY;
+
+	if (d->chan_cnt >= BINDERLIKE_CHAN_MAX)
+		return -ENOSPC;
+
+	dc = &d->chans[d->chan_cnt++];
+	dc->chan = chan;
+	dc->fn = fn;
+	dc->ordered = ordered;
+	dc->busy = 0;
+	return 0;
+}
+
+int binderlike_dispatcher_start(binderlike_dispatcher_t *d)
+{
+	int i, ret = 0;
+
+	if (!d)
+		return -EINVAL;
+
+	d->running = 1;
+	for (i = 0; i < d->worker_cnt; i++)
+	{
+		struct binderlike_dispatch_worker *w = &d->workers[i];
+
+		w->id = i;
+		w->d = d;
+		ret = -pthread_create(&w->thread, NULL, dispatch_worker_loop, w);
+		if (ret)
+		{
+			printf("create dispatch worker %d failed\n", i);
+			d->worker_cnt = i;
+			binderlike_dispatcher_stop(d);
+			break;
+		}
+	}
+	return ret;
+}
+
+void binderlike_dispatcher_stop(binderlike_dispatcher_t *d)
+{
+	int i;
+
+	if (!d || !d->running)
+		return;
+
+	__atomic_store_n(&d->running, 0, __ATOMIC_RELAXED);
+	for (i = 0; i < d->worker_cnt; i++)
+	{
+		pthread_join(d->workers[i].thread, NULL);
+		printf("worker %d handled %lu, stolen %lu\n", i,
+		       d->workers[i].handled, d->workers[i].stolen);
+	}
+}
+
+void binderlike_dispatcher_destroy(binderlike_dispatcher_t *d)
+{
+	binderlike_dispatcher_stop(d);
+	free(d);
+}
@@ -0,0 +1,60 @@
+#ifndef __BINDERLIKE_DISPATCH_H__
+#define __BINDERLIKE_DISPATCH_H__
+#include <pthread.h>
+#include "binderlike_chan.h"
+
+#define BINDERLIKE_DISPATCH_BATCH      16
+#define BINDERLIKE_DISPATCH_WORKER_MAX 16
+#define BINDERLIKE_DISPATCH_IDLE_MS    10
+
+typedef struct __binderlike_param {
+	int                                   chan_id;
+	/* sq entry being handled */
+	const char                           *msg;
+	size_t                                msg_len;
+	/* arena payload, zero-copy and only valid during the call */
+	const void                           *payload;
+	size_t                                payload_len;
+	/* dma-buf the entry carried, owned by the handler, -1 if none */
+	int                                   fd;
+	/* filled by the handler, posted to the cq when result_len > 0 */
+	char                                 *result;
+	size_t                                result_sz;
+	int                                   result_len;
+} binderlike_param_t;
+
+typedef void (*binderlike_fn)(binderlike_param_t* param);
+
+struct binderlike_dispatch_chan {
+	struct moa_binderlike_chan           *chan;
+	binderlike_fn                         fn;
+	/* keep messages of this chan handled one batch at a time, in order */
+	int                                   ordered;
+	/* set while a worker owns the chan */
+	volatile int                          busy;
+};
+
+struct binderlike_dispatch_worker {
+	int                                   id;
+	pthread_t                             thread;
+	struct __binderlike_dispatcher       *d;
+	unsigned long                         handled;
+	unsigned long                         stolen;
+};
+
+typedef struct __binderlike_dispatcher {
+	struct binderlike_dispatch_chan       chans[BINDERLIKE_CHAN_MAX];
+	int                                   chan_cnt;
+	struct binderlike_dispatch_worker     workers[BINDERLIKE_DISPATCH_WORKER_MAX];
+	int                                   worker_cnt;
+	volatile int                          running;
+} binderlike_dispatcher_t;
+
+binderlike_dispatcher_t *binderlike_dispatcher_create(int worker_cnt);
+int binderlike_dispatcher_add_chan(binderlike_dispatcher_t *d,
+				   struct moa_binderlike_chan *chan,
+				   binderlike_fn fn, int ordered);
+int binderlike_dispatcher_start(binderlike_dispatcher_t *d);
+void binderlike_dispatcher_stop(binderlike_dispatcher_t *d);
+void binderlike_dispatcher_destroy(binderlike_dispatcher_t *d);
+#endif
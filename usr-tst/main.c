@@ -8,165 +8,23 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
-#include "../binderlike/binderlike-core.h"
+#include "binderlike_chan.h"
+#include "binderlike_dispatch.h"
 
-struct moa_binderlike_chan;
-
-typedef int (*dqMsg)(struct moa_binderlike_chan *chan, char *buf, size_t len);
-typedef int (*qMsg)(struct moa_binderlike_chan *chan, char *buf, size_t len);
-
-struct moa_binderlike_chan {
-	int fd;
-	struct moa_binderlike_queue *sq;
-	struct moa_binderlike_queue *cq;
-	struct moa_binderlike_chan_info info;
-	dqMsg dequeue;
-	qMsg queue;
-};
-
-#define DEV_NAME "/dev/moa_binderlike"
-#define MOA_BINDERIOC_GET_QUEUE _IOR('B', 0, struct moa_binderlike_queue_cap)
-
-int Msg_Dequeue(struct moa_binderlike_chan *chan, char *buf, size_t sz);
-
-void binderlike_chan_release(struct moa_binderlike_chan *chan)
-{
-	printf("binderlike release\n");
-}
-
-static inline void
-dump_binderlike_chan_info(const struct moa_binderlike_chan_info *info)
-{
-        printf("info [id %d, cache_cnt(%u), mmap_sz(%u), cq_offset(%u)]\n",
-               info->id, info->cache_cnt, info->mmap_sz, info->cq_offset);
-        return;
-}
-
-struct moa_binderlike_chan *binderlike_create_instance(void)
-{
-	int ret = 0;
-	struct moa_binderlike_chan *chan;
-
-	chan = malloc(sizeof(*chan));
-	if (chan)
-	{
-		int fd = -1;
-		memset((void *)chan, 0, sizeof(*chan));
-		fd = open(DEV_NAME, O_RDWR | O_NONBLOCK, S_IRUSR | S_IWUSR);
-		ret = fd > 0 ? 0 : -ENOTTY;
-		chan->fd = fd;
-	}
-
-	if (!ret)
-	{
-		struct moa_binderlike_chan_info *info;
-
-		info = &chan->info;
-
-		info->id = 0;
-		ret = ioctl(chan->fd, MOA_BINDERIOC_CREATE_CHAN, &info);
-		if (ret)
-		{
-			perror("get queue cap failed\n");
-		}
-		else
-		{
-			dump_binderlike_chan_info(info);
-                }
-        }
-
-	if (!ret)
-	{
-		void *addr = NULL;
-                addr = mmap(NULL, chan->info.mmap_sz, PROT_READ | PROT_WRITE,
-                            MAP_SHARED, chan->fd, 0);
-                if (addr) {
-                        chan->sq = (struct moa_binderlike_queue *)addr;
-                        printf("sq %p created, h %d, t %d, len %d\n", chan->sq,
-                               chan->sq->head, chan->sq->tail,
-                               chan->info.cache_cnt);
-
-                        chan->cq = (struct moa_binderlike_queue *)(addr +
-                                   chan->info.cq_offset);
-                        printf("cq %p created, h %d, t %d, len %d\n", chan->cq,
-                               chan->cq->head, chan->cq->tail,
-                               chan->info.cache_cnt);
-                } else {
-                        perror("mmap submit queue failed\n");
-			ret = -ENOMEM;
-                }
-        }
-
-
-	if (!ret)
-	{
-		chan->dequeue = Msg_Dequeue;
-		chan->queue = NULL;
-	}
-
-	if (ret < 0)
-	{
-		binderlike_chan_release(chan);
-	}
-
-	return chan;
-}
-
-int dq_msg(struct moa_binderlike_queue *q, char *buf, size_t sz,
-           unsigned int cache_cnt)
-{
-        int ret = 0;
-        if (q->head == q->tail)
-	{
-		ret = -ENOTTY;
-	}
-
-	if (!ret)
-	{
-		sz = snprintf(buf, sz, "%s", q->msgs[q->head].content);
-		if (buf[sz - 1] == '\n')
-			buf[sz - 1] = '\0';
-		q->head = (q->head + 1) % cache_cnt;
-	}
-
-	return sz;
-}
-
-int qmsg(struct moa_binderlike_queue *q, char *buf, size_t sz)
-{
-	// TODO: to be implememted
-	return 0;
-}
-
-int Msg_Dequeue(struct moa_binderlike_chan *chan, char *buf, size_t sz)
-{
-	int ret = 0;
-	if (!chan ||
-	    !buf ||
-	    !chan->sq)
-	{
-		ret = -EINVAL;
-	}
-
-	if (!ret)
-	{
-		size_t sz;
-		sz = dq_msg(chan->sq, buf, sz, chan->info.cache_cnt);
-		ret = sz;
-	}
-	return ret;
-}
-typedef struct __binderlike_param {
-	/// TODO
-} binderlike_param_t;
-
-typedef void (*binderlike_fn)(binderlike_param_t* param);
+#define APP_DISPATCH_WORKERS 4
 
 typedef struct __binderlike_chan_create_info {
 	int                                   id;
 	binderlike_fn                         fn;
 	int                                   cache_cnt;
 	int                                   param_sz;
+	int                                   ordered;
+	/* bytes of payload arena, 0 for inline messages only */
+	unsigned int                          arena_sz;
+	/* MOA_BINDERLIKE_CHAN_* mode, e.g. conflating parameter updates */
+	unsigned int                          flags;
+	/* capture ring records for traffic recording, 0 for none */
+	unsigned int                          capture_cnt;
 } binderlike_chan_create_info_t;
 
 typedef struct __binderlike_chan_desc {
@@ -183,6 +41,7 @@ typedef struct __app_daemon {
 } app_daemon_t;
 
 static struct moa_binderlike_chan* chan_map[16];
+static binderlike_dispatcher_t* dispatcher;
 
 static inline struct moa_binderlike_chan* rechieve_chan_by_id(int id)
 {
@@ -195,7 +54,7 @@ static binderlike_chan_desc_t* App_Binderlike_Chan_Create(binderlike_chan_create
 {
 	int ret = 0;
 	binderlike_chan_desc_t* pChanDesc = malloc(sizeof(*pChanDesc));
-	struct moa_binderlike_chan *chan;
+	struct moa_binderlike_chan *chan = NULL;
 
 	if (NULL == pChanDesc)
 	{
@@ -204,8 +63,27 @@ static binderlike_chan_desc_t* App_Binderlike_Chan_Create(binderlike_chan_create
 
 	if (0 == ret)
 	{
+		struct moa_binderlike_chan_info req;
+
 		/// add info into create instance
-		chan = binderlike_create_instance();
+		memset(&req, 0, sizeof(req));
+		req.arena_sz = info->arena_sz;
+		req.flags = info->flags;
+		req.capture_cnt = info->capture_cnt;
+		chan = binderlike_create_instance_req(&req);
+		ret = chan ? 0 : -ENODEV;
+	}
+
+	if (0 == ret && NULL == dispatcher)
+	{
+		dispatcher = binderlike_dispatcher_create(APP_DISPATCH_WORKERS);
+		ret = dispatcher ? 0 : -ENOMEM;
+	}
+
+	if (0 == ret)
+	{
+		ret = binderlike_dispatcher_add_chan(dispatcher, chan, info->fn,
+						     info->ordered);
 	}
 
 	if (0 == ret)
@@ -213,9 +91,34 @@ static binderlike_chan_desc_t* App_Binderlike_Chan_Create(binderlike_chan_create
 		pChanDesc->id = chan->info.id;
 		chan_map[pChanDesc->id] = chan;
 	}
+	else
+	{
+		if (chan)
+			binderlike_chan_release(chan);
+		free(pChanDesc);
+		pChanDesc = NULL;
+	}
 	return pChanDesc;
 }
 
+static void App_Daemonize(void)
+{
+	if (binderlike_dispatcher_start(dispatcher))
+	{
+		printf("start binderlike dispatcher failed\n");
+		return;
+	}
+
+	/* workers serve every created chan until the process is killed */
+	while (1)
+		pause();
+}
+
+static app_daemon_t app_daemon __attribute__((unused)) = {
+	.create_binderlike_chan = App_Binderlike_Chan_Create,
+	.app_daemonize = App_Daemonize,
+};
+
 /* just use in main test, keep it for reference */
 #if 0
 int main(int argc, char *argv[])
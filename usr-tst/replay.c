@@ -0,0 +1,379 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "binderlike_chan.h"
+#include "binderlike_capture.h"
+
+/*
+ * replay capture <chan id> <log> <seconds>
+ *	record the sq traffic of a chan into a capture log
+ * replay play <chan id> <log> [speed] [consume]
+ *	re-inject a capture log into a chan, speed 1 keeps the recorded
+ *	pacing, 2 plays twice as fast and 0 posts as fast as the ring takes
+ *	it. With consume set the tool drains the sq itself and reports the
+ *	enqueue to dequeue latency. Each payload then starts with its replay
+ *	sequence in place of its first bytes, so conflated or expired
+ *	records simply have no sample.
+ */
+
+#define REPLAY_DRAIN_MS 1
+/* records still missing after this long were conflated or expired */
+#define REPLAY_IDLE_MS 200
+
+struct replay_stat {
+	unsigned long long                   *v;
+	unsigned int                          cnt;
+};
+
+struct replay_ctx {
+	struct moa_binderlike_chan           *chan;
+	unsigned long long                   *post_ns;
+	unsigned long long                   *deq_ns;
+	unsigned int                          total;
+	volatile unsigned int                 posted;
+	/* records dequeued, and the ones matched to a post */
+	volatile unsigned int                 consumed;
+	unsigned int                          matched;
+	volatile int                          running;
+};
+
+static int replay_cmp(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void replay_report(const char *name, struct replay_stat *st)
+{
+	unsigned long long sum = 0;
+	unsigned int i;
+
+	if (!st->cnt)
+	{
+		printf("%-10s no samples\n", name);
+		return;
+	}
+
+	qsort(st->v, st->cnt, sizeof(st->v[0]), replay_cmp);
+	for (i = 0; i < st->cnt; i++)
+		sum += st->v[i];
+
+	printf("%-10s n %u min %llu avg %llu p50 %llu p99 %llu max %llu us\n",
+	       name, st->cnt, st->v[0] / 1000, sum / st->cnt / 1000,
+	       st->v[st->cnt / 2] / 1000, st->v[st->cnt * 99 / 100] / 1000,
+	       st->v[st->cnt - 1] / 1000);
+}
+
+static int replay_capture(int id, const char *path, int seconds)
+{
+	struct moa_binderlike_chan *chan;
+	unsigned long long end;
+	FILE *out;
+	int n, total = 0, ret;
+
+	chan = binderlike_open_instance(id);
+	if (!chan)
+		return -ENODEV;
+
+	if (!chan->cap)
+	{
+		printf("chan %d was created without a capture ring\n", id);
+		binderlike_chan_release(chan);
+		return -EINVAL;
+	}
+
+	out = fopen(path, "wb");
+	if (!out)
+	{
+		binderlike_chan_release(chan);
+		return -errno;
+	}
+
+	ret = binderlike_capture_start(chan, out);
+	end = binderlike_now_ns() + seconds * 1000000000ULL;
+	while (!ret && binderlike_now_ns() < end)
+	{
+		n = binderlike_capture_drain(chan, out);
+		if (n < 0)
+		{
+			ret = n;
+			break;
+		}
+		total += n;
+		poll(NULL, 0, REPLAY_DRAIN_MS);
+	}
+
+	binderlike_capture_stop(chan);
+	n = binderlike_capture_drain(chan, out);
+	if (n > 0)
+		total += n;
+
+	printf("chan %d: %d records captured, %u dropped\n", id, total,
+	       binderlike_capture_dropped(chan));
+	fclose(out);
+	binderlike_chan_release(chan);
+	return ret;
+}
+
+static void *replay_consume(void *arg)
+{
+	struct replay_ctx *ctx = arg;
+	struct binderlike_span span;
+	struct moa_binderlike_msg *msg;
+	unsigned long long now, idle;
+	unsigned int seq;
+	int n, i;
+
+	idle = binderlike_now_ns();
+	for (;;)
+	{
+		n = Msg_Dequeue_Span(ctx->chan, &span, 16);
+		now = binderlike_now_ns();
+		if (n <= 0)
+		{
+			/* conflated or expired records never show up */
+			if (!ctx->running &&
+			    (ctx->consumed >= __atomic_load_n(&ctx->posted,
+							      __ATOMIC_ACQUIRE) ||
+			     now - idle > REPLAY_IDLE_MS * 1000000ULL))
+				break;
+			binderlike_chan_wait(ctx->chan, REPLAY_DRAIN_MS);
+			continue;
+		}
+
+		for (i = 0; i < n; i++)
+		{
+			msg = binderlike_span_msg(&span, i);
+			if (msg->len < sizeof(seq))
+				continue;
+
+			memcpy(&seq, (const void *)msg->content, sizeof(seq));
+			if (seq < ctx->total && !ctx->deq_ns[seq])
+			{
+				ctx->deq_ns[seq] = now;
+				ctx->matched++;
+			}
+		}
+		ctx->consumed += n;
+		idle = now;
+		dq_span_release(&span);
+	}
+
+	return NULL;
+}
+
+/* post one record, retrying while the ring is full */
+static int replay_post(struct moa_binderlike_chan *chan,
+		       const struct binderlike_cap_rec *rec,
+		       const char *content, unsigned long long rebase)
+{
+	int ret;
+
+	do
+	{
+		if (rec->key)
+			ret = Msg_Queue_Key(chan, rec->key, content, rec->len);
+		else if (rec->deadline_ns)
+			ret = Msg_Queue_Deadline(chan, content, rec->len,
+						 rec->deadline_ns + rebase,
+						 rec->flags);
+		else
+			ret = Msg_Queue(chan, (char *)content, rec->len);
+
+		if (ret == -EBUSY)
+			sched_yield();
+	} while (ret == -EBUSY);
+
+	return ret;
+}
+
+static int replay_play(int id, const char *path, double speed, int consume)
+{
+	struct replay_stat late = { 0 }, post = { 0 }, e2e = { 0 };
+	struct replay_ctx ctx;
+	struct binderlike_cap_hdr hdr;
+	struct binderlike_cap_rec rec;
+	unsigned long long first = 0, start, due, now, t;
+	char content[256];
+	unsigned int len;
+	pthread_t consumer;
+	unsigned int cap = 1024, i;
+	FILE *in;
+	int ret;
+
+	in = fopen(path, "rb");
+	if (!in)
+		return -errno;
+
+	ret = binderlike_capture_open(in, &hdr);
+	if (ret)
+	{
+		fclose(in);
+		return ret;
+	}
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.chan = binderlike_open_instance(id);
+	ctx.post_ns = malloc(cap * sizeof(*ctx.post_ns));
+	late.v = malloc(cap * sizeof(*late.v));
+	post.v = malloc(cap * sizeof(*post.v));
+	if (!ctx.chan || !ctx.post_ns || !late.v || !post.v)
+	{
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* the consumer indexes by dequeue order, size it up front */
+	if (consume)
+	{
+		long pos = ftell(in);
+
+		while (binderlike_capture_read(in, &rec, content,
+					       sizeof(content)) > 0)
+			ctx.total++;
+		fseek(in, pos, SEEK_SET);
+
+		ctx.deq_ns = calloc(ctx.total ? ctx.total : 1,
+				    sizeof(*ctx.deq_ns));
+		if (!ctx.deq_ns)
+		{
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		ctx.running = 1;
+		if (pthread_create(&consumer, NULL, replay_consume, &ctx))
+		{
+			ret = -errno;
+			goto out;
+		}
+	}
+
+	printf("replaying chan %d capture into chan %d, speed %.2f\n",
+	       hdr.chan_id, id, speed);
+
+	start = binderlike_now_ns();
+	while ((ret = binderlike_capture_read(in, &rec, content,
+					      sizeof(content))) > 0)
+	{
+		if (!first)
+			first = rec.ts_ns;
+
+		due = start;
+		if (speed > 0)
+			due += (unsigned long long)((rec.ts_ns - first) / speed);
+
+		while ((now = binderlike_now_ns()) < due)
+		{
+			if (due - now > 200000)
+				usleep((due - now - 100000) / 1000);
+		}
+
+		if (late.cnt == cap)
+		{
+			cap *= 2;
+			ctx.post_ns = realloc(ctx.post_ns,
+					      cap * sizeof(*ctx.post_ns));
+			late.v = realloc(late.v, cap * sizeof(*late.v));
+			post.v = realloc(post.v, cap * sizeof(*post.v));
+			if (!ctx.post_ns || !late.v || !post.v)
+			{
+				ret = -ENOMEM;
+				break;
+			}
+		}
+
+		/* tag the payload so the consumer can tell which post it is */
+		if (consume)
+		{
+			len = rec.len;
+			if (len < sizeof(late.cnt))
+				rec.len = sizeof(late.cnt);
+			memcpy(content, &late.cnt, sizeof(late.cnt));
+		}
+
+		ctx.post_ns[late.cnt] = now;
+		ret = replay_post(ctx.chan, &rec, content, now - rec.ts_ns);
+		if (consume)
+			rec.len = len;
+		t = binderlike_now_ns();
+		if (ret < 0)
+		{
+			printf("post record %u failed, %d\n", late.cnt, ret);
+			break;
+		}
+
+		late.v[late.cnt++] = now - due;
+		post.v[post.cnt++] = t - now;
+		__atomic_store_n(&ctx.posted, late.cnt, __ATOMIC_RELEASE);
+	}
+
+	if (consume)
+	{
+		ctx.running = 0;
+		pthread_join(consumer, NULL);
+
+		e2e.v = malloc((late.cnt ? late.cnt : 1) * sizeof(*e2e.v));
+		for (i = 0; e2e.v && i < late.cnt && i < ctx.total; i++)
+		{
+			if (ctx.deq_ns[i])
+				e2e.v[e2e.cnt++] = ctx.deq_ns[i] - ctx.post_ns[i];
+		}
+
+		printf("%u records dequeued, %u of %u posts matched\n",
+		       ctx.consumed, ctx.matched, late.cnt);
+	}
+
+	printf("%u records in %llu ms, %u expired by consumers\n", late.cnt,
+	       (binderlike_now_ns() - start) / 1000000,
+	       binderlike_chan_expired(ctx.chan));
+	replay_report("lateness", &late);
+	replay_report("post", &post);
+	if (consume)
+		replay_report("e2e", &e2e);
+
+out:
+	free(e2e.v);
+	free(post.v);
+	free(late.v);
+	free(ctx.deq_ns);
+	free(ctx.post_ns);
+	if (ctx.chan)
+		binderlike_chan_release(ctx.chan);
+	fclose(in);
+	return ret < 0 ? ret : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int ret = -EINVAL;
+
+	if (argc >= 5 && !strcmp(argv[1], "capture"))
+	{
+		ret = replay_capture(atoi(argv[2]), argv[3], atoi(argv[4]));
+	}
+	else if (argc >= 4 && !strcmp(argv[1], "play"))
+	{
+		ret = replay_play(atoi(argv[2]), argv[3],
+				  argc > 4 ? atof(argv[4]) : 1.0,
+				  argc > 5 ? atoi(argv[5]) : 0);
+	}
+	else
+	{
+		printf("usage: %s capture <chan id> <log> <seconds>\n"
+		       "       %s play <chan id> <log> [speed] [consume]\n",
+		       argv[0], argv[0]);
+	}
+
+	if (ret)
+		printf("failed, %s\n", strerror(-ret));
+	return ret ? 1 : 0;
+}
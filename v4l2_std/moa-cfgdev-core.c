@@ -4,7 +4,11 @@
 #include <linux/slab.h>
 #include <linux/of.h>
 #include <linux/of_irq.h>
-#include <linux/kthread.h>
+#include <linux/io.h>
+#include <linux/hrtimer.h>
+#include <linux/mutex.h>
+#include <linux/random.h>
+#include <linux/rculist.h>
 #include <linux/wait.h>
 #include "moa-cfgdev-core.h"
 
@@ -17,6 +21,45 @@ module_param(dbg_fake_interrupt_run, int, 0644);
 static int dbg_thd_running = 1;
 module_param(dbg_thd_running, int, 0644);
 
+#define V4L2STD_CTX_MAX 8
+// TODO: parse this param from dts
+#define V4L2STD_VOUT_MAX 9
+
+/* the vout address registers are consecutive words of reg resource 0 */
+#define VOUT_ADDR_REG(vout) ((vout) * sizeof(u32))
+
+#define SIM_FPS_MAX 1000
+/* a ctx with no fps looks again after this long */
+#define SIM_IDLE_NS (100 * NSEC_PER_MSEC)
+
+/* frame rate of each simulated ctx, 0 keeps the ctx quiet */
+static int sim_fps[V4L2STD_CTX_MAX] = { 30 };
+module_param_array(sim_fps, int, NULL, 0644);
+
+/* where SOF, SOL, 3A and VOUT_DONE fire within a frame, in 1/1000 */
+static int sim_stage_permille[VOUT_DONE + 1] = { 0, 50, 500, 950 };
+module_param_array(sim_stage_permille, int, NULL, 0644);
+
+/* each stage fires up to this many us early or late */
+static int sim_jitter_us;
+module_param(sim_jitter_us, int, 0644);
+
+struct moa_cfg_dev;
+
+/* per ctx frame simulator, stands in for the isp irqs */
+struct moa_cfgdev_sim {
+	struct hrtimer timer;
+	struct moa_cfg_dev *cdev;
+	unsigned int ctx;
+	/* stage the timer fires next */
+	int stage;
+	ktime_t frame_start;
+	u64 period_ns;
+	u32 frames;
+	/* frames skipped because the handlers fell a whole frame behind */
+	u32 overruns;
+};
+
 struct moa_cfg_dev {
 	int usr_cnt;
 	char name[256];
@@ -25,9 +68,13 @@ struct moa_cfg_dev {
 
 	u32 irq_setting;
 	u32 irq_num;
+	bool irq_requested;
+	/* vout address registers, not mapped while the simulator runs */
+	void __iomem *vout_regs;
 
 	/* for simu */
-	struct task_struct *fake_irq_thread;
+	bool sim_running;
+	struct moa_cfgdev_sim sim[V4L2STD_CTX_MAX];
 };
 
 #define log_dbg(fmt, arg...)                                                   \
@@ -57,20 +104,32 @@ struct moa_v4l2std_bound {
 	struct moa_v4l2std_queue *q;
 };
 
-#define V4L2STD_CTX_MAX 8
-// TODO: parse this param from dts
-#define V4L2STD_VOUT_MAX 9
+/*
+ * the irq side walks both tables under rcu only. bind and unbind serialize
+ * on ref_bind_mutex, and unbind waits out the readers before returning.
+ */
 static struct list_head ref_ctx_array[V4L2STD_CTX_MAX];
-static DEFINE_SPINLOCK(ref_ctx_spin);
-static struct moa_v4l2std_queue *ref_vout_array[V4L2STD_VOUT_MAX];
-static DEFINE_SPINLOCK(ref_vout_spin);
+static struct moa_v4l2std_queue __rcu *ref_vout_array[V4L2STD_VOUT_MAX];
+static DEFINE_MUTEX(ref_bind_mutex);
+
+static int cfg_vout_update_addr(u32 vout, u32 val)
+{
+	if (vout >= V4L2STD_VOUT_MAX || !g_dev || !g_dev->vout_regs)
+		return -EINVAL;
+
+	writel(val, g_dev->vout_regs + VOUT_ADDR_REG(vout));
+	return 0;
+}
 
-int moa_cfgdev_bind_queue(unsigned int ctx, int vout,
+/*
+ * registers the first vout_cnt vouts of q, a vout feeds a single queue. the
+ * ctx SOL then programs all of them and each VOUT_DONE finds q in O(1).
+ */
+int moa_cfgdev_bind_queue(unsigned int ctx, unsigned int vout_cnt,
 			  struct moa_v4l2std_queue *q)
 {
 	struct list_head *head;
-	int vout_idx;
-	unsigned long flags;
+	unsigned int i;
 
 	if (!q) {
 		log_err("q is null\n");
@@ -82,41 +141,117 @@ int moa_cfgdev_bind_queue(unsigned int ctx, int vout,
 		return -EINVAL;
 	}
 
-	/* TODO: register vout here */
-	(void)vout;
-	head = &ref_ctx_array[ctx];
+	if (!vout_cnt || vout_cnt > ARRAY_SIZE(q->vout)) {
+		log_err("%u vouts can not be bound\n", vout_cnt);
+		return -EINVAL;
+	}
 
-	INIT_LIST_HEAD(&q->ctx_node);
+	for (i = 0; i < vout_cnt; i++) {
+		if (q->vout[i] >= V4L2STD_VOUT_MAX) {
+			log_err("vout %u is too max\n", q->vout[i]);
+			return -EINVAL;
+		}
+	}
 
-	spin_lock_irqsave(&ref_ctx_spin, flags);
-	list_add_tail(&q->ctx_node, head);
-	spin_unlock_irqrestore(&ref_ctx_spin, flags);
+	head = &ref_ctx_array[ctx];
 
-	vout_idx = q->vout[0];
-	spin_lock_irqsave(&ref_vout_spin, flags);
-	ref_vout_array[vout_idx] = q;
-	spin_unlock_irqrestore(&ref_vout_spin, flags);
+	mutex_lock(&ref_bind_mutex);
+	for (i = 0; i < vout_cnt; i++) {
+		if (rcu_access_pointer(ref_vout_array[q->vout[i]])) {
+			mutex_unlock(&ref_bind_mutex);
+			log_err("vout %u is bound already\n", q->vout[i]);
+			return -EBUSY;
+		}
+	}
+
+	/* q may be bound already, it is only touched once the check passed */
+	INIT_LIST_HEAD(&q->ctx_node);
+	q->ctx = ctx;
+	q->vout_used = vout_cnt;
+	/* simulated frames have no vout to program */
+	q->write_addr = g_dev && g_dev->vout_regs ? cfg_vout_update_addr : NULL;
+
+	/* publishes the queue set up above to the irq side */
+	for (i = 0; i < vout_cnt; i++)
+		rcu_assign_pointer(ref_vout_array[q->vout[i]], q);
+	list_add_tail_rcu(&q->ctx_node, head);
+	mutex_unlock(&ref_bind_mutex);
 	return 0;
 }
 
 int moa_cfgdev_unbind_queue(unsigned int ctx, struct moa_v4l2std_queue *q)
 {
-	unsigned long flags;
+	unsigned int i;
+
 	if (!q) {
 		log_err("q is null\n");
 		return -EINVAL;
 	}
 
-	spin_lock_irqsave(&ref_ctx_spin, flags);
-	list_del(&q->ctx_node);
-	spin_unlock_irqrestore(&ref_ctx_spin, flags);
+	mutex_lock(&ref_bind_mutex);
+	/* remove may have unbound q already */
+	if (!q->vout_used ||
+	    rcu_access_pointer(ref_vout_array[q->vout[0]]) != q) {
+		mutex_unlock(&ref_bind_mutex);
+		return 0;
+	}
+
+	list_del_rcu(&q->ctx_node);
+	for (i = 0; i < q->vout_used; i++)
+		if (rcu_access_pointer(ref_vout_array[q->vout[i]]) == q)
+			RCU_INIT_POINTER(ref_vout_array[q->vout[i]], NULL);
+	mutex_unlock(&ref_bind_mutex);
 
-	spin_lock_irqsave(&ref_vout_spin, flags);
-	ref_vout_array[q->vout[0]] = NULL;
-	spin_unlock_irqrestore(&ref_vout_spin, flags);
+	/* no irq handler still runs on q once this returns */
+	synchronize_rcu();
 	return 0;
 }
 
+/*
+ * drop every queue still bound, g_dev is about to go. write_addr is read
+ * under the queue's buf_lock, clearing it there stops new register writes
+ * from the queue's own paths; the caller waits out the irq side.
+ */
+static void moa_cfgdev_unbind_all(void)
+{
+	struct moa_v4l2std_queue *q, *tmp;
+	unsigned long flags;
+	unsigned int ctx, i;
+
+	mutex_lock(&ref_bind_mutex);
+	for (ctx = 0; ctx < ARRAY_SIZE(ref_ctx_array); ctx++) {
+		list_for_each_entry_safe(q, tmp, &ref_ctx_array[ctx],
+					 ctx_node) {
+			log_info("ctx %u still has vout %u bound\n", ctx,
+				 q->vout[0]);
+			list_del_rcu(&q->ctx_node);
+			for (i = 0; i < q->vout_used; i++)
+				RCU_INIT_POINTER(ref_vout_array[q->vout[i]],
+						 NULL);
+
+			spin_lock_irqsave(&q->buf_lock, flags);
+			q->write_addr = NULL;
+			spin_unlock_irqrestore(&q->buf_lock, flags);
+		}
+	}
+	mutex_unlock(&ref_bind_mutex);
+}
+
+/* a vout of ctx finished writing its plane of the frame */
+static void moa_cfgdev_vout_done(unsigned int ctx, unsigned int vout)
+{
+	struct moa_v4l2std_queue *q;
+
+	if (vout >= ARRAY_SIZE(ref_vout_array))
+		return;
+
+	rcu_read_lock();
+	q = rcu_dereference(ref_vout_array[vout]);
+	if (q && q->ctx == ctx)
+		moa_v4l2std_queue_vout_done(q, vout);
+	rcu_read_unlock();
+}
+
 int moa_cfg_register_irqhandle(int ctx, irq_handle handle)
 {
 	(void)ctx;
@@ -160,20 +295,8 @@ static enum irqreturn irq_common(int irq, void *data)
 	return 0;
 }
 
-static int cfg_vout_update_addr(u32 vout, u32 val)
-{
-	// FIXME: it is just a useless demo
-	static void* addr_array[] = {
-		[0] = (void*)0x80000000,
-	};
-
-	writel(val, addr_array[vout]);
-	return 0;
-}
-
 static void moa_cfgdev_update_addr_for_ctx(unsigned int ctx)
 {
-	unsigned long flags;
 	struct moa_v4l2std_queue *q = NULL;
 
 	if (ctx >= ARRAY_SIZE(ref_ctx_array)) {
@@ -181,51 +304,142 @@ static void moa_cfgdev_update_addr_for_ctx(unsigned int ctx)
 		return;
 	}
 
-	spin_lock_irqsave(&ref_ctx_spin, flags);
-	list_for_each_entry(q, &ref_ctx_array[ctx], ctx_node) {
-		spin_unlock_irqrestore(&ref_ctx_spin, flags);
+	rcu_read_lock();
+	list_for_each_entry_rcu(q, &ref_ctx_array[ctx], ctx_node) {
 		/* update vout addr according to the queue's vout */
-		moa_v4l2std_queue_handle_buf(q, cfg_vout_update_addr);
+		moa_v4l2std_queue_handle_buf(q);
+	}
+	rcu_read_unlock();
+}
+
+static void moa_cfgdev_stamp_ctx(unsigned int ctx, int stage)
+{
+	struct moa_v4l2std_queue *q = NULL;
+
+	if (ctx >= ARRAY_SIZE(ref_ctx_array))
+		return;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(q, &ref_ctx_array[ctx], ctx_node)
+		moa_v4l2std_queue_stamp(q, stage);
+	rcu_read_unlock();
+}
+
+/* what the isp irq handlers would do for one stage of ctx */
+static void moa_cfgdev_sim_stage(struct moa_cfg_dev *cdev, unsigned int ctx,
+				 int irq_num)
+{
+	unsigned int vout;
+
+	(void)irq_common(irq_num, (void *)cdev);
 
-		spin_lock_irqsave(&ref_ctx_spin, flags);
+	if (irq_num == SOL)
+		moa_cfgdev_update_addr_for_ctx(ctx);
+
+	/* every vout reports its own done, as the hw raises one each */
+	if (irq_num == VOUT_DONE) {
+		for (vout = 0; vout < V4L2STD_VOUT_MAX; vout++)
+			moa_cfgdev_vout_done(ctx, vout);
 	}
-	spin_unlock_irqrestore(&ref_ctx_spin, flags);
+
+	/* after the stage is handled, so the record carries its buffer */
+	moa_cfgdev_stamp_ctx(ctx, irq_num);
 }
 
-static int moa_cfg_dev_fake_irq(void *data)
+static void moa_cfgdev_sim_reload(struct moa_cfgdev_sim *sim)
 {
-	struct moa_cfg_dev *cdev = (struct moa_cfg_dev *)data;
-	u32 loop = 0;
+	int fps = READ_ONCE(sim_fps[sim->ctx]);
 
-	while (1) {
+	sim->period_ns = fps > 0 ? NSEC_PER_SEC / min(fps, SIM_FPS_MAX) : 0;
+}
 
-		int irq_num = loop % 4;
-		msleep(30);
+static ktime_t moa_cfgdev_sim_expires(struct moa_cfgdev_sim *sim)
+{
+	int permille = clamp(READ_ONCE(sim_stage_permille[sim->stage]), 0, 999);
+	int jitter_us = READ_ONCE(sim_jitter_us);
+	s64 off = div_u64(sim->period_ns * permille, 1000);
 
-		if (!dbg_thd_running) {
-			loop++;
-			continue;
-		}
+	if (jitter_us > 0)
+		off += (s64)(get_random_u32() % (2 * jitter_us + 1)) * 1000 -
+		       (s64)jitter_us * 1000;
 
-		(void)irq_common(irq_num, (void *)cdev);
+	return ktime_add_ns(sim->frame_start, max_t(s64, off, 0));
+}
 
-		if (loop == SOL) {
-			/* 0 is just an example */
-			moa_cfgdev_update_addr_for_ctx(0);
-		}
+static enum hrtimer_restart moa_cfgdev_sim_fire(struct hrtimer *timer)
+{
+	struct moa_cfgdev_sim *sim =
+		container_of(timer, struct moa_cfgdev_sim, timer);
+	ktime_t now = ktime_get();
+
+	/* a quiet ctx only polls its fps */
+	if (!sim->period_ns) {
+		moa_cfgdev_sim_reload(sim);
+		sim->frame_start = ktime_add_ns(now, sim->period_ns ? 0 :
+							       SIM_IDLE_NS);
+		sim->stage = SOF;
+		hrtimer_set_expires(timer, moa_cfgdev_sim_expires(sim));
+		return HRTIMER_RESTART;
+	}
 
-		if (loop == VOUT_DONE) {
-			struct moa_v4l2std_queue *q;
-			list_for_each_entry(q, &ref_ctx_array[0], ctx_node) {
-				moa_v4l2std_queue_notify_complete(q);
-			}
+	if (READ_ONCE(dbg_thd_running))
+		moa_cfgdev_sim_stage(sim->cdev, sim->ctx, sim->stage);
+
+	if (++sim->stage > VOUT_DONE) {
+		sim->stage = SOF;
+		sim->frames++;
+		sim->frame_start = ktime_add_ns(sim->frame_start,
+						sim->period_ns);
+		moa_cfgdev_sim_reload(sim);
+
+		/* never fire a backlog of frames, start over from now */
+		if (ktime_before(sim->frame_start, now)) {
+			sim->overruns++;
+			sim->frame_start = now;
 		}
+	}
 
-		loop++;
+	hrtimer_set_expires(timer, moa_cfgdev_sim_expires(sim));
+	return HRTIMER_RESTART;
+}
+
+static void moa_cfgdev_sim_start(struct moa_cfg_dev *cdev)
+{
+	struct moa_cfgdev_sim *sim;
+	unsigned int ctx;
+
+	for (ctx = 0; ctx < V4L2STD_CTX_MAX; ctx++) {
+		sim = &cdev->sim[ctx];
+		sim->cdev = cdev;
+		sim->ctx = ctx;
+		sim->stage = SOF;
+		sim->frame_start = ktime_get();
+		moa_cfgdev_sim_reload(sim);
+
+		hrtimer_init(&sim->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+		sim->timer.function = moa_cfgdev_sim_fire;
+		hrtimer_start(&sim->timer, moa_cfgdev_sim_expires(sim),
+			      HRTIMER_MODE_ABS);
 	}
-	log_info(" loop %d, cdev %s thread end\n", loop, cdev->name);
+	cdev->sim_running = true;
+}
 
-	return 0;
+static void moa_cfgdev_sim_stop(struct moa_cfg_dev *cdev)
+{
+	struct moa_cfgdev_sim *sim;
+	unsigned int ctx;
+
+	if (!cdev->sim_running)
+		return;
+
+	for (ctx = 0; ctx < V4L2STD_CTX_MAX; ctx++) {
+		sim = &cdev->sim[ctx];
+		hrtimer_cancel(&sim->timer);
+		if (sim->frames)
+			log_info("ctx %u: %u frames, %u overruns\n", ctx,
+				 sim->frames, sim->overruns);
+	}
+	cdev->sim_running = false;
 }
 
 static int moa_cfgdev_irq_init(struct moa_cfg_dev *cfg_dev)
@@ -239,14 +453,10 @@ static int moa_cfgdev_irq_init(struct moa_cfg_dev *cfg_dev)
 				       "moa-cfg-irq comming", (void *)cfg_dev);
 		if (ret < 0)
 			log_err("req irq %d fail\n", irq_num);
+		else
+			cfg_dev->irq_requested = true;
 	} else {
-		cfg_dev->fake_irq_thread = kthread_run(
-			moa_cfg_dev_fake_irq, (void *)cfg_dev, "moa_irq_fake");
-		if (cfg_dev->fake_irq_thread == NULL) {
-			log_err("no valid irq thread created\n");
-			ret = -EBUSY;
-		}
-
+		moa_cfgdev_sim_start(cfg_dev);
 	}
 
 	return ret;
@@ -268,7 +478,7 @@ static int moa_cfgdev_probe(struct platform_device *pdev)
 	g_dev = kzalloc(sizeof(*g_dev), GFP_KERNEL);
 	if (!g_dev) {
 		log_err("alloc memory for moa cfgdev failed\n");
-		ret = -ENOMEM;
+		return -ENOMEM;
 	}
 
 	cdev = g_dev;
@@ -283,11 +493,23 @@ static int moa_cfgdev_probe(struct platform_device *pdev)
 		goto cleanup;
 	}
 
-	if (moa_cfgdev_irq_init(cdev) < 0)
-		goto cleanup;
+	if (!dbg_fake_interrupt_run) {
+		cdev->vout_regs = devm_platform_ioremap_resource(pdev, 0);
+		if (IS_ERR(cdev->vout_regs)) {
+			ret = PTR_ERR(cdev->vout_regs);
+			log_err("map vout regs fail, ret %d\n", ret);
+			goto cleanup;
+		}
+	}
 
+	/* the ctx lists must be ready before the first irq */
 	moa_cfgdev_context_init(cdev);
 
+	ret = moa_cfgdev_irq_init(cdev);
+	if (ret < 0)
+		goto cleanup;
+
+	platform_set_drvdata(pdev, cdev);
 	return ret;
 cleanup:
 	kfree(g_dev);
@@ -303,8 +525,30 @@ static struct of_device_id moa_cfgdev_match[] = {
 	{},
 };
 
+static int moa_cfgdev_remove(struct platform_device *pdev)
+{
+	struct moa_cfg_dev *cdev = platform_get_drvdata(pdev);
+
+	if (!cdev)
+		return 0;
+
+	/* no simulated irq may run once the module text is gone */
+	moa_cfgdev_sim_stop(cdev);
+	if (cdev->irq_requested)
+		devm_free_irq(&pdev->dev, cdev->irq_num, cdev);
+
+	/* bound queues write through g_dev->vout_regs */
+	moa_cfgdev_unbind_all();
+	synchronize_rcu();
+
+	g_dev = NULL;
+	kfree(cdev);
+	return 0;
+}
+
 struct platform_driver moa_cfg_driver = {
 	.probe = moa_cfgdev_probe,
+	.remove = moa_cfgdev_remove,
 	.driver = {
 		.name = "moa,cfgdev",
 		.of_match_table = of_match_ptr(moa_cfgdev_match),
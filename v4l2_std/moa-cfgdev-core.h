@@ -18,7 +18,7 @@ typedef int (*irq_handle)(int irq, void *data);
 int moa_cfg_register_irqhandle(int ctx, irq_handle handle);
 int moa_cfg_unregister_irqhandle(int ctx);
 
-int moa_cfgdev_bind_queue(unsigned int ctx, int vout,
+int moa_cfgdev_bind_queue(unsigned int ctx, unsigned int vout_cnt,
 			  struct moa_v4l2std_queue *q);
 int moa_cfgdev_unbind_queue(unsigned int ctx, struct moa_v4l2std_queue *q);
 #endif
@@ -8,12 +8,14 @@
 
 #include <linux/module.h>
 #include <linux/platform_device.h>
+#include <linux/of.h>
 #include <linux/string.h>
 #include <linux/delay.h>
 #include <linux/spinlock.h>
 #include <media/v4l2-dev.h>
 #include <media/v4l2-device.h>
 #include <media/v4l2-ioctl.h>
+#include <media/v4l2-rect.h>
 #include <media/videobuf2-v4l2.h>
 #include "moa-cfgdev-core.h"
 #include "moa-v4l2std-core.h"
@@ -35,33 +37,154 @@
 		pr_err("[%s](%d)" fmt, __func__, __LINE__, ##arg);             \
 	} while (0)
 
-static inline struct moa_v4l2std_device *file_to_mdev(struct file* f)
+static inline struct moa_v4l2std_port *file_to_port(struct file* f)
 {
 	struct video_device *port_dev = video_devdata(f);
-	struct moa_v4l2std_device *mdev =
-		container_of(port_dev, struct moa_v4l2std_device, port_dev);
-	return mdev;
+	struct moa_v4l2std_port *port =
+		container_of(port_dev, struct moa_v4l2std_port, port_dev);
+	return port;
 }
 
 static int dbg_level = 2;
 module_param(dbg_level, int, 0644);
 
+/* active area of the sensor, the bounds of the crop rectangle */
+static int sensor_width = 1920;
+module_param(sensor_width, int, 0444);
+
+static int sensor_height = 1080;
+module_param(sensor_height, int, 0444);
+
+/* bytes each line is padded to, a power of two */
+static int stride_align = 32;
+module_param(stride_align, int, 0644);
+
+#define V4L2STD_WIDTH_MIN 64
+#define V4L2STD_WIDTH_MAX 4096
+#define V4L2STD_HEIGHT_MIN 64
+#define V4L2STD_HEIGHT_MAX 4096
+
+/*
+ * layouts known to v4l2_format_info only list the fourcc and are filled in
+ * by moa_v4l2std_init_fmt_array, once at module init. packed raw is
+ * described here by hand.
+ */
 static struct moa_v4l2std_fmt fmt_array[] = {
+	{ .fourcc = V4L2_PIX_FMT_NV12, },
+	{ .fourcc = V4L2_PIX_FMT_NV16, },
+	{ .fourcc = V4L2_PIX_FMT_YUYV, },
+	{ .fourcc = V4L2_PIX_FMT_NV12M, },
+	{ .fourcc = V4L2_PIX_FMT_GREY, },
+	{
+		.fourcc = V4L2_PIX_FMT_SRGGB10P,
+		.bpp = 10,
+		.buffers = 1,
+		.planes = 1,
+		.depth = { 10, 0 },
+	},
 	{
-		.fourcc = V4L2_PIX_FMT_NV12,
+		.fourcc = V4L2_PIX_FMT_SRGGB12P,
 		.bpp = 12,
 		.buffers = 1,
-		.planes = 2,
-		.depth = { 8, 0 },
+		.planes = 1,
+		.depth = { 12, 0 },
 	},
 };
 
+static void __init moa_v4l2std_init_fmt_array(void)
+{
+	struct moa_v4l2std_fmt *fmt;
+	const struct v4l2_format_info *info;
+	int i, p;
+
+	for (i = 0; i < ARRAY_SIZE(fmt_array); i++) {
+		fmt = &fmt_array[i];
+
+		if (fmt->planes) {
+			fmt->vinfo.format = fmt->fourcc;
+			fmt->vinfo.mem_planes = fmt->buffers;
+			fmt->vinfo.comp_planes = fmt->planes;
+			fmt->vinfo.hdiv = 1;
+			fmt->vinfo.vdiv = 1;
+			continue;
+		}
+
+		info = v4l2_format_info(fmt->fourcc);
+		if (!info) {
+			log_err("no format info for 0x%08x\n", fmt->fourcc);
+			continue;
+		}
+
+		fmt->vinfo = *info;
+		fmt->buffers = info->mem_planes;
+		fmt->planes = info->comp_planes;
+		fmt->bpp = 0;
+		for (p = 0; p < info->comp_planes; p++) {
+			fmt->depth[p] = info->bpp[p] * 8;
+			fmt->bpp += p ? fmt->depth[p] / (info->hdiv * info->vdiv) :
+					fmt->depth[p];
+		}
+	}
+}
+
+/* fill bytesperline and sizeimage of every memory plane */
+static void moa_v4l2std_fill_planes(const struct moa_v4l2std_fmt *fmt,
+				    struct v4l2_pix_format_mplane *mp)
+{
+	struct v4l2_plane_pix_format *pfmt = mp->plane_fmt;
+	u32 align = is_power_of_2(stride_align) ? stride_align : 32;
+	u32 bpl = ALIGN(DIV_ROUND_UP(mp->width * fmt->depth[0], 8), align);
+	int p;
+
+	mp->num_planes = fmt->buffers;
+	memset(pfmt, 0, sizeof(mp->plane_fmt));
+
+	for (p = 0; p < fmt->planes; p++) {
+		u32 stride = moa_v4l2std_comp_bpl(fmt, bpl, p);
+		u32 size = stride * moa_v4l2std_comp_height(fmt, mp->height, p);
+
+		/* a single buffer carries every component plane back to back */
+		if (fmt->buffers == 1) {
+			if (!p)
+				pfmt[0].bytesperline = stride;
+			pfmt[0].sizeimage += size;
+		} else {
+			pfmt[p].bytesperline = stride;
+			pfmt[p].sizeimage = size;
+		}
+	}
+}
+
+/*
+ * the isp only scales down, so the image fits in the crop rectangle. sizes
+ * are kept even where the chroma is subsampled.
+ */
+static void moa_v4l2std_bound_size(struct moa_v4l2std_port *port,
+				   const struct moa_v4l2std_fmt *fmt,
+				   struct v4l2_pix_format_mplane *mp)
+{
+	v4l_bound_align_image(&mp->width, V4L2STD_WIDTH_MIN, port->crop.width,
+			      fmt->vinfo.hdiv > 1 ? 1 : 0, &mp->height,
+			      V4L2STD_HEIGHT_MIN, port->crop.height,
+			      fmt->vinfo.vdiv > 1 ? 1 : 0, 0);
+}
+
+static void moa_v4l2std_sensor_bounds(struct v4l2_rect *r)
+{
+	r->left = 0;
+	r->top = 0;
+	r->width = clamp(sensor_width, V4L2STD_WIDTH_MIN, V4L2STD_WIDTH_MAX);
+	r->height = clamp(sensor_height, V4L2STD_HEIGHT_MIN,
+			  V4L2STD_HEIGHT_MAX);
+}
+
 struct moa_v4l2std_fmt *moa_v4l2std_match_fmt(int fourcc)
 {
 	int i;
 	struct moa_v4l2std_fmt *fmt = fmt_array;
 	for (i = 0; i < ARRAY_SIZE(fmt_array); i++) {
-		if (fmt_array[i].fourcc == fourcc)
+		/* a format the kernel could not describe is left out */
+		if (fmt_array[i].fourcc == fourcc && fmt_array[i].planes)
 			break;
 		fmt++;
 	}
@@ -71,11 +194,10 @@ struct moa_v4l2std_fmt *moa_v4l2std_match_fmt(int fourcc)
 	return fmt;
 }
 
-static struct moa_v4l2std_device *g_mdev = NULL;
-
 static const struct v4l2_file_operations moa_v4l2_fops = {
 	.open = v4l2_fh_open,
-	.release = v4l2_fh_release,
+	.release = vb2_fop_release,
+	.poll = vb2_fop_poll,
 	.mmap = vb2_fop_mmap,
 	.unlocked_ioctl = video_ioctl2,
 	.read = NULL,
@@ -86,14 +208,13 @@ static int moa_v4l2std_querycap(struct file *file, void *fh,
 		       struct v4l2_capability *cap)
 {
 	int ret = 0;
-	struct moa_v4l2std_device *mdev = file_to_mdev(file);
-	struct video_device *port_dev = &mdev->port_dev;
+	struct moa_v4l2std_port *port = file_to_port(file);
+	struct video_device *port_dev = &port->port_dev;
 
 	cap->capabilities = port_dev->device_caps;
 
 	strscpy(cap->driver, "moa_v4l2std", sizeof(cap->driver));
-	/* TODO: report the port number to user space */
-	strscpy(cap->card, "port0", sizeof(cap->card));
+	strscpy(cap->card, port->name, sizeof(cap->card));
 	strscpy(cap->bus_info, "moa_isp", sizeof(cap->bus_info));
 	return ret;
 }
@@ -120,10 +241,9 @@ static int moa_v4l2std_enum_fmt(struct file *file, void *fh,
 static int moa_v4l2std_try_fmt(struct file *file, void *fh,
 					     struct v4l2_format *f)
 {
+	struct moa_v4l2std_port *port = file_to_port(file);
 	const struct moa_v4l2std_fmt *fmt;
 	struct v4l2_pix_format_mplane *mp = &f->fmt.pix_mp;
-	struct v4l2_plane_pix_format *pfmt = mp->plane_fmt;
-	int p;
 	
 	fmt = moa_v4l2std_match_fmt(mp->pixelformat);
 
@@ -135,19 +255,8 @@ static int moa_v4l2std_try_fmt(struct file *file, void *fh,
 
 	mp->field = V4L2_FIELD_NONE;
 
-	/* TODO: fix the size of image */
-	mp->width = 1920;
-	mp->height = 1080;
-
-	mp->num_planes = fmt->buffers;
-	for (p = 0; p < mp->num_planes; p++) {
-		u32 bpl = ALIGN(mp->width, 32);
-		u32 stride = DIV_ROUND_UP(bpl * fmt->bpp, 8);
-		pfmt[p].bytesperline = stride;
-		pfmt[p].sizeimage = stride * mp->height;
-
-		memset(pfmt[p].reserved, 0, sizeof(pfmt[p].reserved));
-	}
+	moa_v4l2std_bound_size(port, fmt, mp);
+	moa_v4l2std_fill_planes(fmt, mp);
 
 	mp->colorspace = V4L2_COLORSPACE_SMPTE170M;
 	mp->quantization = V4L2_QUANTIZATION_DEFAULT;
@@ -165,8 +274,8 @@ static int moa_v4l2std_set_fmt_mp(struct file *file, void *priv,
 	struct v4l2_pix_format_mplane *mp = &f->fmt.pix_mp;
 	struct video_device *dev = video_devdata(file);
 	struct vb2_queue *q = dev->queue;
-	struct moa_v4l2std_device *mdev =
-		container_of(dev, typeof(*mdev), port_dev);
+	struct moa_v4l2std_port *port =
+		container_of(dev, typeof(*port), port_dev);
 
 	int ret = moa_v4l2std_try_fmt(file, priv, f);
 	if (ret < 0)
@@ -175,8 +284,8 @@ static int moa_v4l2std_set_fmt_mp(struct file *file, void *priv,
 	if (vb2_is_busy(q))
 		return -EBUSY;
 
-	mdev->cur_v4l2_fmt = *f;
-	mdev->cur_fmt = moa_v4l2std_match_fmt(mp->pixelformat);
+	port->cur_v4l2_fmt = *f;
+	port->cur_fmt = moa_v4l2std_match_fmt(mp->pixelformat);
 	return 0;
 }
 
@@ -185,40 +294,36 @@ static int moa_v4l2std_g_fmt_mp(struct file *file, void *priv,
 {
 	struct v4l2_pix_format_mplane *mp = &f->fmt.pix_mp;
 	struct video_device *dev = video_devdata(file);
-	struct moa_v4l2std_device *mdev =
-		container_of(dev, typeof(*mdev), port_dev);
+	struct moa_v4l2std_port *port =
+		container_of(dev, typeof(*port), port_dev);
 
-	struct v4l2_pix_format_mplane *cur_mp = &mdev->cur_v4l2_fmt.fmt.pix_mp;
+	struct v4l2_pix_format_mplane *cur_mp = &port->cur_v4l2_fmt.fmt.pix_mp;
 
 	memcpy(mp, cur_mp, sizeof(struct v4l2_pix_format_mplane));
 	return 0;
 }
 
-static void moa_v4l2std_init_fmt(struct moa_v4l2std_device *mdev)
+static void moa_v4l2std_init_fmt(struct moa_v4l2std_port *port)
 {
 	const struct moa_v4l2std_fmt *fmt;
-	struct v4l2_format *f = &mdev->cur_v4l2_fmt;
+	struct v4l2_format *f = &port->cur_v4l2_fmt;
 	struct v4l2_pix_format_mplane *mp = &f->fmt.pix_mp;
-	struct v4l2_plane_pix_format *pfmt = mp->plane_fmt;
-	int p;
 
 	memset(mp, 0, sizeof(*mp));
 	fmt = &fmt_array[0];
+	port->cur_fmt = &fmt_array[0];
 
-	mp->field = V4L2_FIELD_NONE;
+	moa_v4l2std_sensor_bounds(&port->crop);
 
-	mp->width = 1920;
-	mp->height = 1080;
+	f->type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	mp->pixelformat = fmt->fourcc;
+	mp->field = V4L2_FIELD_NONE;
 
-	mp->num_planes = fmt->buffers;
-	for (p = 0; p < mp->num_planes; p++) {
-		u32 bpl = ALIGN(mp->width, 32);
-		u32 stride = DIV_ROUND_UP(bpl * fmt->bpp, 8);
-		pfmt[p].bytesperline = stride;
-		pfmt[p].sizeimage = stride * mp->height;
+	mp->width = port->crop.width;
+	mp->height = port->crop.height;
+	moa_v4l2std_bound_size(port, fmt, mp);
 
-		memset(pfmt[p].reserved, 0, sizeof(pfmt[p].reserved));
-	}
+	moa_v4l2std_fill_planes(fmt, mp);
 
 	mp->colorspace = V4L2_COLORSPACE_SMPTE170M;
 	mp->quantization = V4L2_QUANTIZATION_DEFAULT;
@@ -229,6 +334,79 @@ static void moa_v4l2std_init_fmt(struct moa_v4l2std_device *mdev)
 	memset(mp->reserved, 0, sizeof(mp->reserved));
 }
 
+static int moa_v4l2std_enum_framesizes(struct file *file, void *fh,
+				       struct v4l2_frmsizeenum *fsize)
+{
+	struct moa_v4l2std_port *port = file_to_port(file);
+	const struct moa_v4l2std_fmt *fmt;
+
+	fmt = moa_v4l2std_match_fmt(fsize->pixel_format);
+	if (!fmt || fsize->index)
+		return -EINVAL;
+
+	fsize->type = V4L2_FRMSIZE_TYPE_STEPWISE;
+	fsize->stepwise.min_width = V4L2STD_WIDTH_MIN;
+	fsize->stepwise.max_width = port->crop.width;
+	fsize->stepwise.step_width = fmt->vinfo.hdiv > 1 ? 2 : 1;
+	fsize->stepwise.min_height = V4L2STD_HEIGHT_MIN;
+	fsize->stepwise.max_height = port->crop.height;
+	fsize->stepwise.step_height = fmt->vinfo.vdiv > 1 ? 2 : 1;
+	return 0;
+}
+
+static int moa_v4l2std_g_selection(struct file *file, void *fh,
+				   struct v4l2_selection *s)
+{
+	struct moa_v4l2std_port *port = file_to_port(file);
+
+	if (s->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+		return -EINVAL;
+
+	switch (s->target) {
+	case V4L2_SEL_TGT_CROP:
+		s->r = port->crop;
+		break;
+	case V4L2_SEL_TGT_CROP_DEFAULT:
+	case V4L2_SEL_TGT_CROP_BOUNDS:
+		moa_v4l2std_sensor_bounds(&s->r);
+		break;
+	default:
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int moa_v4l2std_s_selection(struct file *file, void *fh,
+				   struct v4l2_selection *s)
+{
+	struct moa_v4l2std_port *port = file_to_port(file);
+	struct v4l2_pix_format_mplane *mp = &port->cur_v4l2_fmt.fmt.pix_mp;
+	struct v4l2_rect bounds;
+	struct v4l2_rect r = s->r;
+
+	if (s->type != V4L2_BUF_TYPE_VIDEO_CAPTURE ||
+	    s->target != V4L2_SEL_TGT_CROP)
+		return -EINVAL;
+
+	if (vb2_is_busy(&port->queue.q))
+		return -EBUSY;
+
+	moa_v4l2std_sensor_bounds(&bounds);
+	r.width = clamp_t(u32, ALIGN(r.width, 2), V4L2STD_WIDTH_MIN,
+			  bounds.width);
+	r.height = clamp_t(u32, ALIGN(r.height, 2), V4L2STD_HEIGHT_MIN,
+			   bounds.height);
+	v4l2_rect_map_inside(&r, &bounds);
+
+	port->crop = r;
+	s->r = r;
+
+	/* the isp does not scale up, shrink the format to the new window */
+	moa_v4l2std_bound_size(port, port->cur_fmt, mp);
+	moa_v4l2std_fill_planes(port->cur_fmt, mp);
+	return 0;
+}
+
 static const struct v4l2_ioctl_ops moa_v4l2_ioctl_ops = {
 	.vidioc_querycap = moa_v4l2std_querycap,
 	.vidioc_enum_fmt_vid_cap = moa_v4l2std_enum_fmt,
@@ -239,55 +417,170 @@ static const struct v4l2_ioctl_ops moa_v4l2_ioctl_ops = {
 	.vidioc_try_fmt_vid_cap_mplane = moa_v4l2std_try_fmt,
 	.vidioc_s_fmt_vid_cap_mplane = moa_v4l2std_set_fmt_mp,
 	.vidioc_g_fmt_vid_cap_mplane = moa_v4l2std_g_fmt_mp,
+	.vidioc_enum_framesizes = moa_v4l2std_enum_framesizes,
+
+	.vidioc_g_selection = moa_v4l2std_g_selection,
+	.vidioc_s_selection = moa_v4l2std_s_selection,
 
 	.vidioc_reqbufs = vb2_ioctl_reqbufs,
+	.vidioc_create_bufs = vb2_ioctl_create_bufs,
+	.vidioc_prepare_buf = vb2_ioctl_prepare_buf,
 	.vidioc_querybuf = vb2_ioctl_querybuf,
 	.vidioc_qbuf = vb2_ioctl_qbuf,
 	.vidioc_dqbuf = vb2_ioctl_dqbuf,
+	.vidioc_expbuf = vb2_ioctl_expbuf,
 
 	.vidioc_streamon = vb2_ioctl_streamon,
 	.vidioc_streamoff = vb2_ioctl_streamoff,
 };
 
-static int moa_v4l2std_update_fmt(struct device *dev,
+static int moa_v4l2std_update_fmt(struct moa_v4l2std_queue *q,
 				  struct moa_v4l2std_fmt *mfmt)
 {
-	struct v4l2_device *vdev = dev_get_drvdata(dev);
-	struct moa_v4l2std_device *mdev =
-		container_of(vdev, typeof(*mdev), vdev);
-	struct v4l2_pix_format_mplane *mp = &mfmt->vfmt.fmt.pix_mp;
-	struct v4l2_pix_format_mplane *cur_mp = &mdev->cur_v4l2_fmt.fmt.pix_mp;
+	struct moa_v4l2std_port *port =
+		container_of(q, struct moa_v4l2std_port, queue);
 
-	memcpy(mp, cur_mp, sizeof(struct v4l2_pix_format_mplane));
+	/* the queue needs the plane layout as well as the v4l2 format */
+	*mfmt = *port->cur_fmt;
+	mfmt->vfmt = port->cur_v4l2_fmt;
 
 	return 0;
 }
 
 static void moa_v4l2std_video_dev_release(struct video_device *vdev)
 {
-	/* TODO: a void release, implement it later */
+	/* ports live in moa_v4l2std_device, each drops its v4l2_device ref */
+}
+
+/* the last port node is gone, no open file can reach mdev anymore */
+static void moa_v4l2std_v4l2_dev_release(struct v4l2_device *vdev)
+{
+	kfree(container_of(vdev, struct moa_v4l2std_device, vdev));
+}
+
+/*
+ * every available child node is a port:
+ *	port@0 {
+ *		label = "main";
+ *		moa,ctx = <0>;
+ *		moa,vouts = <0 1>;
+ *	};
+ * with no child the device gets a single port on ctx 0, vout 0.
+ */
+static void moa_v4l2std_parse_ports(struct moa_v4l2std_device *mdev,
+				    struct device_node *np)
+{
+	struct moa_v4l2std_port *port;
+	struct device_node *child;
+	const char *label;
+	int cnt;
+
+	for_each_available_child_of_node(np, child) {
+		if (mdev->port_cnt >= ARRAY_SIZE(mdev->ports)) {
+			log_err("only %zu ports supported\n",
+				ARRAY_SIZE(mdev->ports));
+			of_node_put(child);
+			break;
+		}
+
+		port = &mdev->ports[mdev->port_cnt];
+		port->index = mdev->port_cnt++;
+
+		if (of_property_read_u32(child, "moa,ctx", &port->queue.ctx))
+			port->queue.ctx = 0;
+
+		cnt = of_property_read_variable_u32_array(child, "moa,vouts",
+				port->queue.vout, 1,
+				ARRAY_SIZE(port->queue.vout));
+		if (cnt < 0) {
+			log_err("port %u has no vout, use vout %u\n",
+				port->index, port->index);
+			port->queue.vout[0] = port->index;
+			cnt = 1;
+		}
+		port->queue.vout_cnt = cnt;
+
+		if (of_property_read_string(child, "label", &label))
+			snprintf(port->name, sizeof(port->name), "port%u",
+				 port->index);
+		else
+			strscpy(port->name, label, sizeof(port->name));
+	}
+
+	if (!mdev->port_cnt) {
+		port = &mdev->ports[0];
+		port->index = mdev->port_cnt++;
+		port->queue.ctx = 0;
+		port->queue.vout[0] = 0;
+		port->queue.vout_cnt = 1;
+		snprintf(port->name, sizeof(port->name), "port0");
+	}
+}
+
+static int moa_v4l2std_port_register(struct moa_v4l2std_device *mdev,
+				     struct moa_v4l2std_port *port,
+				     struct device *dev)
+{
+	struct video_device *port_dev = &port->port_dev;
+	int ret;
+
+	port->mdev = mdev;
+
+	ret = moa_v4l2std_queue_init(&port->queue, dev,
+				     moa_v4l2std_update_fmt);
+	if (ret < 0) {
+		log_err("init vb2 queue of %s fail, ret %d\n", port->name,
+			ret);
+		return ret;
+	}
+
+	moa_v4l2std_init_fmt(port);
+
+	snprintf(port_dev->name, sizeof(port_dev->name), "moa-%s", port->name);
+	port_dev->v4l2_dev = &mdev->vdev;
+	port_dev->fops = &moa_v4l2_fops;
+
+	port_dev->ioctl_ops = &moa_v4l2_ioctl_ops;
+	port_dev->release = moa_v4l2std_video_dev_release;
+
+	port_dev->device_caps = V4L2_CAP_DEVICE_CAPS | V4L2_CAP_IO_MC |
+				V4L2_CAP_VIDEO_CAPTURE_MPLANE |
+				V4L2_CAP_STREAMING;
+
+	port_dev->queue = &port->queue.q;
+
+	mutex_init(&port->port_lock);
+	port_dev->lock = &port->port_lock;
+
+	video_set_drvdata(port_dev, port);
+	ret = video_register_device(port_dev, VFL_TYPE_VIDEO, -1);
+	if (ret < 0) {
+		log_err("register %s fail, ret %d\n", port->name, ret);
+		vb2_queue_release(&port->queue.q);
+	}
+	return ret;
+}
+
+static void moa_v4l2std_unregister_ports(struct moa_v4l2std_device *mdev,
+					 unsigned int cnt)
+{
+	unsigned int i;
+
+	for (i = 0; i < cnt; i++)
+		video_unregister_device(&mdev->ports[i].port_dev);
 }
 
 static int moa_v4l2std_probe(struct platform_device *pdev)
 {
 	int ret = 0;
+	unsigned int i;
 	struct moa_v4l2std_device *mdev;
 
 	log_info("++.\n");
-	// make sure that moa_v4l2std_device is an singltance
-	if (g_mdev) {
-		log_info("exiting moa v4l2std device\n");
-		ret = -EINVAL;
-		goto end;
-	} else {
-		mdev = kzalloc(sizeof(*g_mdev), GFP_KERNEL);
-	}
-
+	mdev = kzalloc(sizeof(*mdev), GFP_KERNEL);
 	if (!mdev) {
 		ret = -ENOMEM;
 		goto end;
-	} else {
-		g_mdev = mdev;
 	}
 
 	// set v4l2 device info and register
@@ -296,70 +589,50 @@ static int moa_v4l2std_probe(struct platform_device *pdev)
 	if (ret < 0)
 		goto clean_up;
 
-	mdev->vdev.ctrl_handler = NULL; // FIXME
-
-	moa_v4l2std_queue_init(&mdev->queue, &pdev->dev,
-			       moa_v4l2std_update_fmt);
-
-	moa_v4l2std_init_fmt(mdev);
+	/* from here on mdev is freed by the last v4l2_device_put */
+	mdev->vdev.release = moa_v4l2std_v4l2_dev_release;
 
-	// set video device info and register
-	{
-		struct video_device *port_dev = &mdev->port_dev;
-		snprintf(port_dev->name, sizeof(port_dev->name), "moa-core");
-		port_dev->v4l2_dev = &mdev->vdev;
-		port_dev->fops = &moa_v4l2_fops;
-
-		port_dev->ioctl_ops = &moa_v4l2_ioctl_ops;
-		port_dev->release = moa_v4l2std_video_dev_release;
-
-		port_dev->device_caps = V4L2_CAP_DEVICE_CAPS | V4L2_CAP_IO_MC |
-					V4L2_CAP_VIDEO_CAPTURE_MPLANE |
-					V4L2_CAP_STREAMING;
-
-		port_dev->queue = &mdev->queue.q;
+	mdev->vdev.ctrl_handler = NULL; // FIXME
 
-		mutex_init(&mdev->port_lock);
-		port_dev->lock = &mdev->port_lock;
+	moa_v4l2std_parse_ports(mdev, pdev->dev.of_node);
 
-		ret = video_register_device(port_dev, VFL_TYPE_VIDEO, -1);
-		video_set_drvdata(port_dev, mdev);
+	// set video device info and register for every port
+	for (i = 0; i < mdev->port_cnt; i++) {
+		ret = moa_v4l2std_port_register(mdev, &mdev->ports[i],
+						&pdev->dev);
+		if (ret < 0)
+			goto unregister;
 	}
 
-
-	log_info("--.\n");
-	return ret;
+	log_info("--. %u ports\n", mdev->port_cnt);
+	return 0;
+unregister:
+	moa_v4l2std_unregister_ports(mdev, i);
+	v4l2_device_unregister(&mdev->vdev);
+	v4l2_device_put(&mdev->vdev);
+	goto end;
 clean_up:
-	kfree(g_mdev);
-	g_mdev = NULL;
+	kfree(mdev);
 end:
 	return ret;
 }
 
-void moa_v4l2std_dev_release(struct device *dev)
+int moa_v4l2std_driver_remove(struct platform_device *pdev)
 {
-	struct v4l2_device *vdev = dev_get_drvdata(dev);
-	struct moa_v4l2std_device *mdev = NULL;
+	struct v4l2_device *vdev = platform_get_drvdata(pdev);
+	struct moa_v4l2std_device *mdev;
 
 	if (!vdev) {
 		log_err(" dev drvdata has been corrupted\n");
-		return;
+		return -EINVAL;
 	}
 
 	mdev = container_of(vdev, struct moa_v4l2std_device, vdev);
-	if (mdev != g_mdev) {
-		log_err(" dev drvdata has been corrupted\n");
-	}
-
-	kfree(mdev);
-	g_mdev = NULL;
-}
-
-int moa_v4l2std_driver_remove(struct platform_device *pdev)
-{
-	int ret = 0;	
-	// TODO
-	return ret;
+	moa_v4l2std_unregister_ports(mdev, mdev->port_cnt);
+	v4l2_device_unregister(&mdev->vdev);
+	/* open port files keep mdev until they are closed */
+	v4l2_device_put(&mdev->vdev);
+	return 0;
 }
 
 static struct of_device_id v4l2std_match[] = {
@@ -383,7 +656,9 @@ int __init moa_driver_init(void)
 {
 	int ret = 0;
 	log_info("++.\n");
-	
+
+	/* a second pass would take filled entries for hand described ones */
+	moa_v4l2std_init_fmt_array();
 	ret = platform_driver_register(&moa_v4l2std_driver);
 	
 	if (ret < 0) {
@@ -8,21 +8,32 @@
 #include <linux/mutex.h>
 #include "moa-v4l2std-queue.h"
 
-struct moa_v4l2std_device {
-	struct video_device port_dev;
-	struct v4l2_device vdev;
+#define V4L2STD_PORT_MAX 8
 
-	/* queue relevant data type */
-	struct vb2_queue q;
-	struct list_head done_buf_list;
-	struct list_head inqueued_buf_list;
+struct moa_v4l2std_device;
+
+/* one video node, streaming one isp ctx out of its own vouts */
+struct moa_v4l2std_port {
+	struct video_device port_dev;
+	struct moa_v4l2std_device *mdev;
+	unsigned int index;
+	char name[32];
 
 	struct moa_v4l2std_queue queue;
 
 	struct moa_v4l2std_fmt *cur_fmt;
 	struct v4l2_format cur_v4l2_fmt;
+	/* sensor window the isp reads, the format is scaled down from it */
+	struct v4l2_rect crop;
 
 	struct mutex port_lock;
 };
 
+struct moa_v4l2std_device {
+	struct v4l2_device vdev;
+
+	unsigned int port_cnt;
+	struct moa_v4l2std_port ports[V4L2STD_PORT_MAX];
+};
+
 #endif // __MOA_V4L2STD_CORE_H__
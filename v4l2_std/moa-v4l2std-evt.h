@@ -0,0 +1,41 @@
+#ifndef __MOA_V4L2STD_EVT_H__
+#define __MOA_V4L2STD_EVT_H__
+
+/*
+ * record a moa_v4l2std_queue posts into its binderlike evt chan, shared
+ * with userspace daemons. Stage indexes follow enum isp_irq.
+ */
+#define MOA_V4L2STD_EVT_MAGIC 0x4d464556
+
+enum moa_v4l2std_evt_stage {
+	MOA_V4L2STD_EVT_SOF = 0,
+	MOA_V4L2STD_EVT_SOL = 1,
+	MOA_V4L2STD_EVT_3A = 2,
+	MOA_V4L2STD_EVT_VOUT_DONE = 3,
+	MOA_V4L2STD_EVT_STAGE_MAX,
+};
+
+/* what a record describes, stage and ts_ns are only set for a frame */
+enum moa_v4l2std_evt_kind {
+	MOA_V4L2STD_EVT_FRAME = 0,
+	MOA_V4L2STD_EVT_STREAMON = 1,
+	MOA_V4L2STD_EVT_STREAMOFF = 2,
+};
+
+struct moa_v4l2std_frame_evt {
+	unsigned int magic;
+	/* latest stage stamped when the record was posted */
+	unsigned int stage;
+	unsigned int ctx;
+	unsigned int vout;
+	/* vb2 index of the buffer, -1 when no buffer was queued */
+	int index;
+	unsigned int sequence;
+	unsigned int bytesused;
+	/* enum moa_v4l2std_evt_kind */
+	unsigned int kind;
+	/* CLOCK_MONOTONIC ns of each stage, 0 if not reached */
+	unsigned long long ts_ns[MOA_V4L2STD_EVT_STAGE_MAX];
+};
+
+#endif
@@ -1,13 +1,36 @@
+#ifndef __MOA_V4L2STD_FORMAT_H__
+#define __MOA_V4L2STD_FORMAT_H__
 #include <media/v4l2-common.h>
 #define V4L2STD_PLANE_MAX 8
 
 struct moa_v4l2std_fmt {
 	u32 fourcc;
 	int bpp;
+	/* memory planes */
 	int buffers;
+	/* color component planes */
 	int planes;
+	/* bits per pixel of each component plane, before subsampling */
 	int depth[V4L2STD_PLANE_MAX];
 	struct v4l2_format vfmt;
 	struct v4l2_format_info vinfo;
 };
 
+/* bytes per line of component plane p, given the line of plane 0 */
+static inline u32 moa_v4l2std_comp_bpl(const struct moa_v4l2std_fmt *fmt,
+				       u32 bpl, unsigned int p)
+{
+	if (!p || !fmt->depth[0])
+		return bpl;
+	return DIV_ROUND_UP(bpl * fmt->depth[p],
+			    fmt->depth[0] * fmt->vinfo.hdiv);
+}
+
+static inline u32 moa_v4l2std_comp_height(const struct moa_v4l2std_fmt *fmt,
+					  u32 height, unsigned int p)
+{
+	if (!p)
+		return height;
+	return DIV_ROUND_UP(height, fmt->vinfo.vdiv);
+}
+#endif
@@ -1,10 +1,26 @@
 #include <linux/module.h>
 #include "moa-v4l2std-queue.h"
+#include "moa-cfgdev-core.h"
+#include "../binderlike/binderlike-core.h"
 #include <media/videobuf2-dma-contig.h>
+#include <linux/dma-mapping.h>
 
 static int dbg_level;
 module_param(dbg_level, int, 0644);
 
+static int evt_chan = -1;
+module_param(evt_chan, int, 0644);
+
+/* stages whose frame record is posted to evt_chan */
+static int evt_mask = BIT(MOA_V4L2STD_EVT_SOL) | BIT(MOA_V4L2STD_EVT_VOUT_DONE);
+module_param(evt_mask, int, 0644);
+
+/* a ctx that has not started a frame by then is not running */
+#define V4L2STD_STOP_TIMEOUT_MS 200
+
+/* frames latched at SOL the vouts may still be writing */
+#define V4L2STD_FRAMES_IN_FLIGHT 2
+
 #define vb_to_mbuf(vb)                                                         \
 	container_of_safe(container_of(vb, struct vb2_v4l2_buffer, vb2_buf),   \
 			  struct moa_v4l2std_buf, vvb)
@@ -29,62 +45,276 @@ module_param(dbg_level, int, 0644);
 		pr_err("[%s](%d)" fmt, __func__, __LINE__, ##arg);             \
 	} while (0)
 
-int moa_v4l2std_queue_handle_buf(struct moa_v4l2std_queue *q,
-				 write_plane_addr cb)
+/* called with buf_lock held */
+static void moa_v4l2std_queue_refill(struct moa_v4l2std_queue *q)
 {
 	struct moa_v4l2std_buf *buf;
-	struct vb2_buffer *vb;
+
+	buf = list_first_entry_or_null(&q->inqueue_list, typeof(*buf), node);
+	if (buf)
+		list_del(&buf->node);
+	q->next = buf;
+}
+
+/* write the buffer into the vout shadow registers, buf_lock held */
+static void moa_v4l2std_queue_program(struct moa_v4l2std_queue *q,
+				      struct moa_v4l2std_buf *buf)
+{
+	struct vb2_buffer *vb = &buf->vvb.vb2_buf;
+	write_plane_addr cb = q->write_addr;
 	unsigned int i;
-	buf = list_first_entry(&q->inqueue_list, typeof(*buf), node);
 
-	vb = &buf->vvb.vb2_buf;
+	q->shadow = buf;
+	if (!cb)
+		return;
 
-	if (cb) {
-		if (vb->num_planes == 1) {
-			/* handle with contingous buffer */
-			u32 vaddr_base = (u32)vb2_plane_vaddr(vb, 0);
-			for (i = 0; i < buf->comp_planes; i++) {
-				u32 vaddr = vaddr_base + buf->comp_offsets[i];
-				cb(q->vout[i], vaddr);
-			}
-		} else if (vb->num_planes > 1) {
-			/* handle with multi plane in multi buffer */
-			for (i = 0; i < vb->num_planes; i++)
-				cb(q->vout[i], (u32)vb2_plane_vaddr(vb, i));
+	if (vb->num_planes == 1) {
+		/* handle with contingous buffer, a single vout writes it whole */
+		u32 addr_base = (u32)vb2_dma_contig_plane_dma_addr(vb, 0);
+		for (i = 0; i < min(buf->comp_planes, q->vout_used); i++) {
+			u32 addr = addr_base + buf->comp_offsets[i];
+			cb(q->vout[i], addr);
 		}
+	} else if (vb->num_planes > 1) {
+		/* handle with multi plane in multi buffer */
+		for (i = 0; i < vb->num_planes; i++)
+			cb(q->vout[i],
+			   (u32)vb2_dma_contig_plane_dma_addr(vb, i));
 	}
+}
 
-	list_move(&buf->node, &q->done_list);
+/* point every vout of the format at the scratch buffer, buf_lock held */
+static void moa_v4l2std_queue_program_scratch(struct moa_v4l2std_queue *q)
+{
+	write_plane_addr cb = q->write_addr;
+	unsigned int i;
+
+	q->shadow = NULL;
+	if (!cb || !q->scratch)
+		return;
+
+	/* the content is thrown away, so the planes may overlap */
+	for (i = 0; i < q->vout_used; i++)
+		cb(q->vout[i], (u32)q->scratch_dma);
+}
+
+/* a zero address stops the vouts at the next SOL, buf_lock held */
+static void moa_v4l2std_queue_program_stop(struct moa_v4l2std_queue *q)
+{
+	write_plane_addr cb = q->write_addr;
+	unsigned int i;
+
+	if (!cb)
+		return;
+
+	for (i = 0; i < q->vout_used; i++)
+		cb(q->vout[i], 0);
+}
+
+/* move the next pending buffer into the shadow registers, buf_lock held */
+static void moa_v4l2std_queue_arm(struct moa_v4l2std_queue *q)
+{
+	struct moa_v4l2std_buf *buf = q->next;
+
+	if (!buf) {
+		moa_v4l2std_queue_program_scratch(q);
+		return;
+	}
+
+	moa_v4l2std_queue_program(q, buf);
+	moa_v4l2std_queue_refill(q);
+}
+
+/*
+ * SOL, the hw has latched the shadow registers: the shadow buffer becomes
+ * active and the next pending one is programmed while this frame is written.
+ * the frame is numbered here, so a frame that went to scratch leaves a gap in
+ * the sequence userspace sees.
+ */
+int moa_v4l2std_queue_handle_buf(struct moa_v4l2std_queue *q)
+{
+	struct moa_v4l2std_buf *buf;
+	unsigned long flags;
+	u32 sequence;
+
+	spin_lock_irqsave(&q->buf_lock, flags);
+	if (q->parked) {
+		/* the vouts latched the stop address, streamoff may go on */
+		q->stopped = true;
+		spin_unlock_irqrestore(&q->buf_lock, flags);
+		wake_up(&q->stop_wq);
+		return -ENOBUFS;
+	}
+
+	sequence = q->sequence++;
+	buf = q->shadow;
+	if (buf) {
+		buf->vvb.sequence = sequence;
+		list_add_tail(&buf->node, &q->active_list);
+		q->cur_evt.index = buf->vvb.vb2_buf.index;
+	} else {
+		q->frame_dropped++;
+	}
+	q->cur_evt.sequence = sequence;
+	q->cur_evt.vout = q->vout[0];
+	moa_v4l2std_queue_arm(q);
+	spin_unlock_irqrestore(&q->buf_lock, flags);
+
+	if (!buf) {
+		log_dbg("frame %u of vout %u went to scratch\n", sequence,
+			q->vout[0]);
+		return -ENOBUFS;
+	}
 	return 0;
 }
 
+/*
+ * VOUT_DONE, frames complete in order. The done frame is numbered against
+ * the SOL count: a done with no frame latched since the last one (before
+ * the first SOL, or after the parking SOL) is spurious, and a done count
+ * that fell behind the frames the vouts can still write is resynced. An
+ * active buffer older than the done frame missed its done and goes back
+ * with an error, a scratch frame has no buffer to hand.
+ */
 int moa_v4l2std_queue_notify_complete(struct moa_v4l2std_queue *q)
 {
-	struct moa_v4l2std_buf *buf;
-	struct vb2_buffer *vb;
+	struct moa_v4l2std_buf *buf, *tmp;
+	struct vb2_buffer *vb = NULL;
+	unsigned long flags;
+	LIST_HEAD(stale);
+	u32 sequence;
 
 	if (!q) {
 		log_err("v4l2std queue is NULL\n");
 		return -EINVAL;
 	}
 
-	if (list_empty(&q->done_list)) {
-		log_err("no valid buffer in done queue\n");
-		return -EINVAL;
+	spin_lock_irqsave(&q->buf_lock, flags);
+	if (q->done_sequence == q->sequence) {
+		spin_unlock_irqrestore(&q->buf_lock, flags);
+		log_dbg("done with no frame latched on vout %u\n", q->vout[0]);
+		return -ENOBUFS;
 	}
 
-	buf = list_first_entry(&q->done_list, typeof(*buf), node);
+	if (q->sequence - q->done_sequence > V4L2STD_FRAMES_IN_FLIGHT)
+		q->done_sequence = q->sequence - V4L2STD_FRAMES_IN_FLIGHT;
+	sequence = q->done_sequence++;
+
+	list_for_each_entry_safe(buf, tmp, &q->active_list, node) {
+		if ((s32)(buf->vvb.sequence - sequence) > 0)
+			break;
 
-	vb = &buf->vvb.vb2_buf;
+		list_del(&buf->node);
+		if (buf->vvb.sequence != sequence) {
+			list_add_tail(&buf->node, &stale);
+			continue;
+		}
+
+		vb = &buf->vvb.vb2_buf;
+		vb->timestamp = ktime_get_ns();
+		q->cur_evt.index = vb->index;
+		q->cur_evt.sequence = sequence;
+		q->cur_evt.bytesused = vb2_get_plane_payload(vb, 0);
+		break;
+	}
+	spin_unlock_irqrestore(&q->buf_lock, flags);
+
+	list_for_each_entry_safe(buf, tmp, &stale, node) {
+		log_dbg("frame %u missed its done\n", buf->vvb.sequence);
+		list_del(&buf->node);
+		vb2_buffer_done(&buf->vvb.vb2_buf, VB2_BUF_STATE_ERROR);
+	}
+
+	if (!vb) {
+		log_dbg("frame %u has no buffer to complete\n", sequence);
+		return -ENOBUFS;
+	}
 
 	vb2_buffer_done(vb, VB2_BUF_STATE_DONE);
 	return 0;
 }
 
+/*
+ * every vout of the queue writes its own plane, the frame is complete once
+ * all of them are done.
+ */
+int moa_v4l2std_queue_vout_done(struct moa_v4l2std_queue *q, u32 vout)
+{
+	unsigned long flags;
+	unsigned int i;
+	bool done;
+
+	for (i = 0; i < q->vout_used; i++)
+		if (q->vout[i] == vout)
+			break;
+
+	if (i == q->vout_used)
+		return -EINVAL;
+
+	spin_lock_irqsave(&q->buf_lock, flags);
+	__set_bit(i, &q->vout_done);
+	done = q->vout_done == GENMASK(q->vout_used - 1, 0);
+	if (done)
+		q->vout_done = 0;
+	spin_unlock_irqrestore(&q->buf_lock, flags);
+
+	if (!done)
+		return 0;
+	return moa_v4l2std_queue_notify_complete(q);
+}
+
+/* called from the irq path, must not sleep nor allocate */
+static void moa_v4l2std_queue_publish(struct moa_v4l2std_queue *q)
+{
+	struct moa_binderlike_chan *chan;
+	struct moa_binderlike_msg *msg;
+
+	rcu_read_lock();
+	chan = READ_ONCE(q->evt_chan);
+	if (!chan)
+		goto out;
+
+	msg = moa_binderlike_chan_reserve(chan);
+	if (IS_ERR(msg)) {
+		q->evt_dropped++;
+		goto out;
+	}
+
+	memcpy(msg->content, &q->cur_evt, sizeof(q->cur_evt));
+	msg->len = sizeof(q->cur_evt);
+	moa_binderlike_chan_commit(chan, msg);
+out:
+	rcu_read_unlock();
+}
+
+void moa_v4l2std_queue_stamp(struct moa_v4l2std_queue *q, int stage)
+{
+	struct moa_v4l2std_frame_evt *evt = &q->cur_evt;
+
+	if (stage < 0 || stage >= MOA_V4L2STD_EVT_STAGE_MAX)
+		return;
+
+	/* a new frame starts a new record */
+	if (stage == MOA_V4L2STD_EVT_SOF) {
+		memset(evt, 0, sizeof(*evt));
+		evt->magic = MOA_V4L2STD_EVT_MAGIC;
+		evt->ctx = q->ctx;
+		evt->vout = q->vout[0];
+		evt->index = -1;
+	}
+
+	evt->ts_ns[stage] = ktime_get_ns();
+	evt->stage = stage;
+
+	if (evt_mask & BIT(stage))
+		moa_v4l2std_queue_publish(q);
+}
+
 static void moa_v4l2std_buf_queue(struct vb2_buffer *vb)
 {
 	struct moa_v4l2std_buf *buf;
 	struct moa_v4l2std_queue *q;
+	unsigned long flags;
 
 	if (!vb) {
 		log_err("invalid vb\n");
@@ -94,8 +324,16 @@ static void moa_v4l2std_buf_queue(struct vb2_buffer *vb)
 	buf = vb_to_mbuf(vb);
 	q = vb_to_mqueue(vb);
 
-	list_add_tail(&buf->node, &q->inqueue_list);
-	return;
+	spin_lock_irqsave(&q->buf_lock, flags);
+	if (!q->next)
+		q->next = buf;
+	else
+		list_add_tail(&buf->node, &q->inqueue_list);
+
+	/* the shadow registers are free, so the buffer still makes next SOL */
+	if (!q->shadow && !q->parked && vb2_start_streaming_called(&q->q))
+		moa_v4l2std_queue_arm(q);
+	spin_unlock_irqrestore(&q->buf_lock, flags);
 }
 
 static int moa_v4l2std_queue_setup(struct vb2_queue *q,
@@ -105,6 +343,7 @@ static int moa_v4l2std_queue_setup(struct vb2_queue *q,
 	struct moa_v4l2std_queue *queue =
 		container_of_safe(q, typeof(*queue), q);
 	struct v4l2_pix_format_mplane *mp = &queue->cur_mfmt.vfmt.fmt.pix_mp;
+	unsigned int p;
 
 	if (!queue) {
 		log_err("vb2 queue from v4l2 framework is NULL\n");
@@ -120,8 +359,21 @@ static int moa_v4l2std_queue_setup(struct vb2_queue *q,
 		return -ENODEV;
 	}
 
-	queue->update_cb(q->dev, &queue->cur_mfmt);
+	queue->update_cb(queue, &queue->cur_mfmt);
+
+	/* CREATE_BUFS, the sizes come from the caller */
+	if (*num_planes) {
+		if (*num_planes != mp->num_planes)
+			return -EINVAL;
+		for (p = 0; p < *num_planes; p++)
+			if (sizes[p] < mp->plane_fmt[p].sizeimage)
+				return -EINVAL;
+		return 0;
+	}
+
 	*num_planes = mp->num_planes;
+	for (p = 0; p < *num_planes; p++)
+		sizes[p] = mp->plane_fmt[p].sizeimage;
 
 	return 0;
 }
@@ -138,33 +390,243 @@ static int moa_v4l2std_prepare_buf(struct vb2_buffer *vb)
 		struct v4l2_pix_format_mplane *pix_mp =
 			&queue->cur_mfmt.vfmt.fmt.pix_mp;
 		struct moa_v4l2std_fmt *mfmt = &queue->cur_mfmt;
+		u32 bpl = pix_mp->plane_fmt[0].bytesperline;
+		u32 offset = 0;
 		unsigned int i;
 
-		mbuf->comp_planes = mfmt->vinfo.comp_planes;
-		mbuf->comp_offsets[0] = 0;
-		for (i = 1; i < ARRAY_SIZE(mbuf->comp_offsets); i++) {
-			if (i < mbuf->comp_planes)
-				mbuf->comp_offsets[i] =
-					pix_mp->plane_fmt[0].bytesperline *
-					pix_mp->height;
-			else
+		for (i = 0; i < pix_mp->num_planes; i++) {
+			u32 size = pix_mp->plane_fmt[i].sizeimage;
+
+			if (vb2_plane_size(vb, i) < size) {
+				log_err("plane %u is %lu bytes, %u needed\n", i,
+					vb2_plane_size(vb, i), size);
+				return -EINVAL;
+			}
+			vb2_set_plane_payload(vb, i, size);
+		}
+
+		/* component planes packed back to back in a single buffer */
+		mbuf->comp_planes = min_t(unsigned int, mfmt->vinfo.comp_planes,
+					  ARRAY_SIZE(queue->vout));
+		for (i = 0; i < ARRAY_SIZE(mbuf->comp_offsets); i++) {
+			if (i < mbuf->comp_planes && pix_mp->num_planes == 1) {
+				mbuf->comp_offsets[i] = offset;
+				offset += moa_v4l2std_comp_bpl(mfmt, bpl, i) *
+					  moa_v4l2std_comp_height(mfmt,
+								  pix_mp->height, i);
+			} else {
 				mbuf->comp_offsets[i] = 0;
+			}
 		}
 	}
 	return 0;
 }
 
+/* stream state goes through the evt chan as the same binary record */
+static void moa_v4l2std_queue_post_evt(struct moa_v4l2std_queue *queue,
+				       enum moa_v4l2std_evt_kind kind)
+{
+	struct moa_v4l2std_frame_evt evt = {
+		.magic = MOA_V4L2STD_EVT_MAGIC,
+		.kind = kind,
+		.ctx = queue->ctx,
+		.vout = queue->vout[0],
+		.index = -1,
+		.sequence = queue->sequence,
+	};
+	int ret;
+
+	if (!queue->evt_chan)
+		return;
+
+	ret = moa_binderlike_chan_post(queue->evt_chan, &evt, sizeof(evt));
+	if (ret < 0)
+		log_err("post evt %d to binderlike chan fail, ret %d\n", kind,
+			ret);
+}
+
+/* hand every buffer the driver still owns back to vb2 */
+static void moa_v4l2std_queue_return_bufs(struct moa_v4l2std_queue *queue,
+					  enum vb2_buffer_state state)
+{
+	struct moa_v4l2std_buf *buf, *tmp;
+	unsigned long flags;
+	LIST_HEAD(bufs);
+
+	spin_lock_irqsave(&queue->buf_lock, flags);
+	list_splice_tail_init(&queue->active_list, &bufs);
+	if (queue->shadow)
+		list_add_tail(&queue->shadow->node, &bufs);
+	if (queue->next)
+		list_add_tail(&queue->next->node, &bufs);
+	list_splice_tail_init(&queue->inqueue_list, &bufs);
+	queue->shadow = NULL;
+	queue->next = NULL;
+	spin_unlock_irqrestore(&queue->buf_lock, flags);
+
+	list_for_each_entry_safe(buf, tmp, &bufs, node) {
+		list_del(&buf->node);
+		vb2_buffer_done(&buf->vvb.vb2_buf, state);
+	}
+}
+
+static int moa_v4l2std_queue_alloc_scratch(struct moa_v4l2std_queue *queue)
+{
+	struct v4l2_pix_format_mplane *mp = &queue->cur_mfmt.vfmt.fmt.pix_mp;
+	size_t size = 0;
+	unsigned int p;
+
+	for (p = 0; p < mp->num_planes && p < VIDEO_MAX_PLANES; p++)
+		size = max_t(size_t, size, mp->plane_fmt[p].sizeimage);
+
+	if (!size) {
+		log_err("no plane size to allocate scratch for\n");
+		return -EINVAL;
+	}
+
+	queue->scratch = dma_alloc_coherent(queue->q.dev, size,
+					    &queue->scratch_dma, GFP_KERNEL);
+	if (!queue->scratch)
+		return -ENOMEM;
+
+	queue->scratch_size = size;
+	return 0;
+}
+
+static void moa_v4l2std_queue_free_scratch(struct moa_v4l2std_queue *queue)
+{
+	if (!queue->scratch)
+		return;
+
+	dma_free_coherent(queue->q.dev, queue->scratch_size, queue->scratch,
+			  queue->scratch_dma);
+	queue->scratch = NULL;
+	queue->scratch_size = 0;
+}
+
+/*
+ * a vout per plane, either per memory plane or per packed component. a port
+ * with fewer vouts than components has its single buffer written whole by
+ * one vout.
+ */
+static unsigned int moa_v4l2std_queue_vouts(struct moa_v4l2std_queue *queue)
+{
+	struct v4l2_pix_format_mplane *mp = &queue->cur_mfmt.vfmt.fmt.pix_mp;
+	unsigned int comps;
+
+	if (mp->num_planes > 1)
+		return mp->num_planes;
+
+	comps = max_t(unsigned int, queue->cur_mfmt.vinfo.comp_planes, 1);
+	return comps <= queue->vout_cnt ? comps : 1;
+}
+
 static int moa_v4l2std_queue_streamon(struct vb2_queue *q, unsigned int count)
 {
-	/* TODO: connect to binderlike here */
+	struct moa_v4l2std_queue *queue =
+		container_of_safe(q, typeof(*queue), q);
+	unsigned int vouts = moa_v4l2std_queue_vouts(queue);
+	unsigned long flags;
+	int ret;
+
 	log_info(" entering stream on for v4l2 std\n");
+
+	if (vouts > queue->vout_cnt) {
+		log_err("format needs %u vouts, %u available\n", vouts,
+			queue->vout_cnt);
+		moa_v4l2std_queue_return_bufs(queue, VB2_BUF_STATE_QUEUED);
+		return -EINVAL;
+	}
+
+	ret = moa_v4l2std_queue_alloc_scratch(queue);
+	if (ret < 0) {
+		log_err("alloc scratch buffer fail, ret %d\n", ret);
+		moa_v4l2std_queue_return_bufs(queue, VB2_BUF_STATE_QUEUED);
+		return ret;
+	}
+
+	spin_lock_irqsave(&queue->buf_lock, flags);
+	queue->sequence = 0;
+	queue->done_sequence = 0;
+	queue->frame_dropped = 0;
+	queue->vout_done = 0;
+	queue->parked = false;
+	queue->stopped = false;
+	spin_unlock_irqrestore(&queue->buf_lock, flags);
+
+	/* from here the ctx irqs reach the queue */
+	ret = moa_cfgdev_bind_queue(queue->ctx, vouts, queue);
+	if (ret < 0) {
+		log_err("bind ctx %u vout %u fail, ret %d\n", queue->ctx,
+			queue->vout[0], ret);
+		moa_v4l2std_queue_free_scratch(queue);
+		moa_v4l2std_queue_return_bufs(queue, VB2_BUF_STATE_QUEUED);
+		return ret;
+	}
+
+	/* prime the shadow registers so the first SOL already has a buffer */
+	spin_lock_irqsave(&queue->buf_lock, flags);
+	if (!queue->shadow)
+		moa_v4l2std_queue_arm(queue);
+	spin_unlock_irqrestore(&queue->buf_lock, flags);
+
+	if (evt_chan >= 0) {
+		queue->evt_dropped = 0;
+		WRITE_ONCE(queue->evt_chan, moa_binderlike_chan_get(evt_chan));
+		if (!queue->evt_chan)
+			log_err("binderlike chan %d is not available\n",
+				evt_chan);
+	}
+
+	moa_v4l2std_queue_post_evt(queue, MOA_V4L2STD_EVT_STREAMON);
 	return 0;
 }
 
 static void moa_v4l2std_queue_streamoff(struct vb2_queue *q)
 {
-	/* TODO: connect to binderlike here */
+	struct moa_v4l2std_queue *queue =
+		container_of_safe(q, typeof(*queue), q);
+	struct moa_binderlike_chan *chan;
+	unsigned long flags;
+
 	log_info(" entering stream off for v4l2 std\n");
+
+	/*
+	 * park the vouts while the ctx irqs still reach the queue. the SOL
+	 * that latches the stop address comes after the frame in flight, no
+	 * vout writes to our buffers or scratch once it has been seen.
+	 */
+	spin_lock_irqsave(&queue->buf_lock, flags);
+	queue->parked = true;
+	moa_v4l2std_queue_program_stop(queue);
+	spin_unlock_irqrestore(&queue->buf_lock, flags);
+
+	if (!wait_event_timeout(queue->stop_wq, READ_ONCE(queue->stopped),
+				msecs_to_jiffies(V4L2STD_STOP_TIMEOUT_MS)))
+		log_info("no SOL on ctx %u since parking, it is idle\n",
+			 queue->ctx);
+
+	moa_cfgdev_unbind_queue(queue->ctx, queue);
+
+	moa_v4l2std_queue_post_evt(queue, MOA_V4L2STD_EVT_STREAMOFF);
+
+	/* wait for the irq path to stop posting before dropping the chan */
+	chan = xchg(&queue->evt_chan, NULL);
+	synchronize_rcu();
+	moa_binderlike_chan_put(chan);
+
+	if (queue->evt_dropped)
+		log_err("%u frame records dropped, evt chan full\n",
+			queue->evt_dropped);
+
+	if (queue->frame_dropped)
+		log_info("%u of %u frames dropped, no buffer queued\n",
+			 queue->frame_dropped, queue->sequence);
+
+	moa_v4l2std_queue_return_bufs(queue, VB2_BUF_STATE_ERROR);
+
+	/* the vouts are stopped, nothing writes to scratch anymore */
+	moa_v4l2std_queue_free_scratch(queue);
 }
 
 static struct vb2_ops qops = {
@@ -174,26 +636,18 @@ static struct vb2_ops qops = {
 
 	.start_streaming = moa_v4l2std_queue_streamon,
 	.stop_streaming = moa_v4l2std_queue_streamoff,
-};
-
-static struct vb2_mem_ops moa_v4l2std_memops = {};
-
-void *moa_v4l2std_buf_vaddr(void *buf_priv)
-{
-	struct vb2_mem_ops *ops = &moa_v4l2std_memops;
-	u32 offset = 0;
-
-	if (!ops->cookie)
-		return NULL;
 
-	return (void *)((u32)ops->cookie(buf_priv) + offset);
-}
+	.wait_prepare = vb2_ops_wait_prepare,
+	.wait_finish = vb2_ops_wait_finish,
+};
 
-static struct vb2_mem_ops *moa_v4l2std_get_memops(void)
+/*
+ * the vouts are programmed with the dma address of each plane, which the
+ * dma-contig allocator keeps for both its own and imported dmabufs.
+ */
+static const struct vb2_mem_ops *moa_v4l2std_get_memops(void)
 {
-	moa_v4l2std_memops = vb2_dma_contig_memops;
-	moa_v4l2std_memops.vaddr = moa_v4l2std_buf_vaddr;
-	return &moa_v4l2std_memops;
+	return &vb2_dma_contig_memops;
 }
 
 int moa_v4l2std_queue_init(struct moa_v4l2std_queue *q, struct device *dev,
@@ -205,12 +659,26 @@ int moa_v4l2std_queue_init(struct moa_v4l2std_queue *q, struct device *dev,
 
 	queue = &q->q;
 
+	queue->type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	/* DMABUF imports, MMAP buffers can be exported with EXPBUF */
+	queue->io_modes = VB2_MMAP | VB2_DMABUF;
+	queue->buf_struct_size = sizeof(struct moa_v4l2std_buf);
+	queue->timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
 	queue->ops = &qops;
 	queue->mem_ops = moa_v4l2std_get_memops();
+	queue->dev = dev;
 
 	mutex_init(&q->q_mutex);
 	queue->lock = &q->q_mutex;
 
+	spin_lock_init(&q->buf_lock);
+	INIT_LIST_HEAD(&q->inqueue_list);
+	INIT_LIST_HEAD(&q->active_list);
+	q->next = NULL;
+	q->shadow = NULL;
+	q->scratch = NULL;
+	init_waitqueue_head(&q->stop_wq);
+
 	q->update_cb = cb;
-	return 0;
+	return vb2_queue_init(queue);
 }
@@ -3,17 +3,51 @@
 #include <media/videobuf2-core.h>
 #include <media/videobuf2-v4l2.h>
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
 #include "moa-v4l2std-format.h"
+#include "moa-v4l2std-evt.h"
 
-typedef int (*moa_v4l2std_fmt_update)(struct device *dev,
+struct moa_v4l2std_queue;
+
+typedef int (*moa_v4l2std_fmt_update)(struct moa_v4l2std_queue *q,
 				      struct moa_v4l2std_fmt *fmt);
 
 typedef int (*write_plane_addr)(u32 vout, u32 val);
 
+struct moa_binderlike_chan;
+struct moa_v4l2std_buf;
+
 struct moa_v4l2std_queue {
 	struct vb2_queue q;
-	struct list_head done_list;
+	/*
+	 * a buffer walks pending -> shadow -> active:
+	 * pending, queued by userspace and not handed to the hw yet. next is
+	 * the head popped off inqueue_list ahead of time, only NULL while
+	 * inqueue_list is empty too.
+	 * shadow, its address is in the vout shadow registers and the hw
+	 * latches it at the next SOL.
+	 * active, latched and being written, completed in order at VOUT_DONE.
+	 * with no pending buffer the shadow registers point at the scratch
+	 * buffer instead and shadow is NULL, the frame is dropped.
+	 */
 	struct list_head inqueue_list;
+	struct moa_v4l2std_buf *next;
+	struct moa_v4l2std_buf *shadow;
+	struct list_head active_list;
+	/* guards the buffer states, taken from the irq path */
+	spinlock_t buf_lock;
+	/* writes a plane address into a vout shadow register */
+	write_plane_addr write_addr;
+	/* streamoff parked the vouts, and a SOL latched that since */
+	bool parked;
+	bool stopped;
+	wait_queue_head_t stop_wq;
+
+	/* driver owned sink for frames nobody queued a buffer for */
+	void *scratch;
+	dma_addr_t scratch_dma;
+	size_t scratch_size;
 
 	struct v4l2_format cur_fmt;
 	struct moa_v4l2std_fmt cur_mfmt;
@@ -22,8 +56,27 @@ struct moa_v4l2std_queue {
 	struct list_head ctx_node;
 
 	u32 vout[3];
+	/* vouts from DT, and how many of them the format writes */
+	unsigned int vout_cnt;
+	unsigned int vout_used;
+	/* vouts done with the oldest active frame, one bit per vout[] slot */
+	unsigned long vout_done;
 
 	struct mutex q_mutex;
+
+	/* binderlike chan the queue posts its events to, if any */
+	struct moa_binderlike_chan *evt_chan;
+
+	/* isp ctx the queue is bound to */
+	unsigned int ctx;
+	/* record of the frame in flight, filled from the irq path */
+	struct moa_v4l2std_frame_evt cur_evt;
+	/* frames latched at SOL and completed at VOUT_DONE since streamon */
+	u32 sequence;
+	u32 done_sequence;
+	/* frames written to scratch, they leave a gap in the sequence */
+	u32 frame_dropped;
+	u32 evt_dropped;
 };
 
 struct moa_v4l2std_buf {
@@ -38,7 +91,8 @@ struct moa_v4l2std_buf {
 int moa_v4l2std_queue_init(struct moa_v4l2std_queue *q, struct device *dev,
 			   moa_v4l2std_fmt_update cb);
 
-int moa_v4l2std_queue_handle_buf(struct moa_v4l2std_queue *q,
-				 write_plane_addr cb);
+int moa_v4l2std_queue_handle_buf(struct moa_v4l2std_queue *q);
 int moa_v4l2std_queue_notify_complete(struct moa_v4l2std_queue *q);
+int moa_v4l2std_queue_vout_done(struct moa_v4l2std_queue *q, u32 vout);
+void moa_v4l2std_queue_stamp(struct moa_v4l2std_queue *q, int stage);
 #endif